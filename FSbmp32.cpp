@@ -18,7 +18,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(_WIN32) || defined(WIN32)
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 
 #define BUILD_VERSION "20131126-1.0.00080 ALPHA"
 
@@ -33,7 +68,8 @@
 #define FS_DXT5 7
 #define STD_16 8
 #define MASK_16 9
-char* filetype[10] = {	"Undefined / other",
+#define STD_INDEXED 10
+char* filetype[11] = {	"Undefined / other",
 			"Standard 24-bit",
 			"Standard 32-bit",
 			"Flight Simulator 32-bit",
@@ -42,39 +78,487 @@ char* filetype[10] = {	"Undefined / other",
 			"Flight Simulator DXT3",
 			"Flight Simulator DXT5",
 			"Standard 16-bit",
-			"16-bit with bit masks"};
-
-// This section defines various buffers and files used
-FILE* bmpFile;
-unsigned char* inputFileBuffer;
-unsigned char* convertFileBuffer;
-unsigned char* outputFileBuffer;
-unsigned char* outputHeaderBuffer;
-
-// ints holding input and output file type
-int inputFileType;
-int outputFileType;
-
-// global variables holding image properties
-unsigned int width;
-unsigned int height;
-unsigned int inputFileSize;
-unsigned int outputFileSize;
-unsigned int inputHeaderSize;
-unsigned int inputBufferSize;
-unsigned int convertBufferSize;
-unsigned int outputHeaderSize;
-unsigned int outputBufferSize;
-
-// For 16-bit with mask
-unsigned int bitmask_red;
-unsigned int bitmask_green;
-unsigned int bitmask_blue;
-unsigned int bitmask_alpha;
-
-// Other global variables
-int inputReadSuccess;
-bool mips;
+			"16-bit with bit masks",
+			"Standard indexed colour"};
+
+// Containers the image data can be wrapped in
+#define CONT_BMP 0
+#define CONT_DDS 1
+
+// Lossless orientation transforms; rotating by 180 degrees is both at once
+#define XFORM_NONE 0
+#define XFORM_FLIP 1
+#define XFORM_MIRROR 2
+#define XFORM_ROTATE_180 3
+
+// Record formats for --inspect
+#define INSPECT_NONE 0
+#define INSPECT_JSON 1
+#define INSPECT_CSV 2
+
+// Largest estimated error, per channel out of 255, that --auto accepts from a compressed format
+#define AUTO_MAX_ERROR 16
+
+// Layouts of 16-bit output, named from the highest bits down; LAYOUT_AUTO picks one from the alpha
+#define LAYOUT_AUTO -1
+#define LAYOUT_565 0
+#define LAYOUT_1555 1
+#define LAYOUT_4444 2
+const char* layoutNames[3] = { "565", "1555", "4444" };
+// Bits per channel (blue, green, red, alpha), blue in the lowest bits
+const unsigned int layoutBits[3][4] = { { 5, 6, 5, 0 }, { 5, 5, 5, 1 }, { 4, 4, 4, 4 } };
+
+// 4x4 ordered dither thresholds, indexed by position in a block
+const unsigned int bayer4x4[16] = { 0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5 };
+
+// Images are split into chunks of whole block rows that idle threads can take.
+// With OpenMP 4.5 task loops the chunks of every file in flight share one pool;
+// older OpenMP (e.g. Visual C++) gets a dynamically scheduled loop per image.
+#if defined(_OPENMP) && _OPENMP >= 201511
+#define USE_TASKLOOP
+#define OMP_PRAGMA(x) _Pragma(#x)
+#define PARALLEL_CHUNKS(grain) OMP_PRAGMA(omp taskloop grainsize(grain))
+#elif defined(_MSC_VER)
+#define PARALLEL_CHUNKS(grain) __pragma(omp parallel for schedule(dynamic))
+#else
+#define OMP_PRAGMA(x) _Pragma(#x)
+#define PARALLEL_CHUNKS(grain) OMP_PRAGMA(omp parallel for schedule(dynamic, grain))
+#endif
+
+// Roughly how much 32-bit pixel data one chunk covers, sized to stay in L2 cache
+#define CHUNK_BYTES 262144
+
+// Instruction sets the block converters are built for.  GCC and Clang on x86 build one copy
+// of each per level and pick at run time; other compilers get the baseline only.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+#endif
+#define CPU_BASELINE 0
+#define CPU_SSE41 1
+#define CPU_AVX2 2
+#define CPU_AVX512 3
+const char* cpuLevelNames[4] = { "baseline", "sse4.1", "avx2", "avx512" };
+
+// Command line options that say what to do with each file; a daemon request carries its own
+struct JobOptions {
+	char selection; // menu selection applied to every file without asking, 0 to ask
+	unsigned int previewSize; // longest side of the preview to make instead of converting, 0 if none
+	unsigned int maxSize; // images wider than this are halved until they fit, 0 for no limit
+	int layout; // --layout for 16-bit output
+	bool dither; // --dither for 16-bit output
+	bool renormalize; // --renormalize normal maps after each halving for --max-size
+	const char* output; // --output, NULL to write next to the input; "-" is standard output
+};
+JobOptions jobOptions;
+
+// Command line options for the whole process
+unsigned int ioDepth; // number of upcoming files whose reads are started ahead of time
+int threadCount; // 0 leaves the choice to OpenMP
+bool pinThreads;
+int inspectFormat; // list header details instead of converting, INSPECT_NONE if not
+int cpuLevel; // instruction set the block converters run with
+int cpuRequest; // --cpu level, -1 to use the best the machine has
+bool showVersion;
+unsigned long long memBudget; // --mem-budget in bytes, 0 for no limit
+const char* daemonPath; // --daemon socket to serve requests on
+const char* clientPath; // --client socket to send this command line to
+const char* bundlePath; // --bundle file the converted files are packed into, NULL to write them out
+const char* extractPath; // --extract bundle to take files out of
+bool profiling; // --profile, cleared again if the counters cannot be opened
+FILE* dataOutput; // the real standard output once messages have been moved to standard error
+
+// --profile: hardware counters for every conv_* kernel, by thread (Linux only).  Each worker
+// thread counts its own events in one perf_event group.  A kernel reads every thread's group
+// before and after it runs and is charged the difference, so files are converted one at a
+// time while profiling.  Threads spinning idle in the OpenMP runtime are counted too: those
+// are cycles the kernel kept them from other work.
+#define PROFILE_EVENTS 5
+#define PROFILE_MAX_KERNELS 64
+#define PROFILE_CYCLES 0
+#define PROFILE_INSTRUCTIONS 1
+#define PROFILE_L1D_MISSES 2
+#define PROFILE_LLC_MISSES 3
+#define PROFILE_BRANCH_MISSES 4
+
+int profileThreads;
+int* profileFds; // threads x events, -1 where the event could not be opened; the first is the group leader
+int* profileSlots; // threads x events, position of the event in its group's reading, -1 if absent
+
+// What one kernel has been charged
+struct KernelCounters {
+	char name[64];
+	unsigned long long calls;
+	unsigned long long pixels;
+	unsigned long long counts[1]; // threads x events, allocated with the rest
+};
+KernelCounters* profileKernels[PROFILE_MAX_KERNELS];
+int profileKernelCount;
+
+// Opens the counter group of the calling thread.  Returns 0, or the errno if the cycle counter fails.
+int openProfileCounters(int thread) {
+#if defined(__linux__)
+	static const unsigned int types[PROFILE_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+	static const unsigned long long configs[PROFILE_EVENTS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_BRANCH_MISSES };
+	int* fds = profileFds + thread * PROFILE_EVENTS;
+	int* slots = profileSlots + thread * PROFILE_EVENTS;
+	int next = 0;
+	for (int e = 0; e < PROFILE_EVENTS; e++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[e];
+		attr.config = configs[e];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, e == 0 ? -1 : fds[0], 0);
+		if (fds[e] < 0 && e == 0)
+			return errno;
+		slots[e] = fds[e] >= 0 ? next++ : -1;
+	}
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+void closeProfileCounters() {
+#if defined(__linux__)
+	for (int i = 0; i < profileThreads * PROFILE_EVENTS; i++)
+		if (profileFds[i] >= 0)
+			close(profileFds[i]);
+#endif
+}
+
+// Opens counters on every worker thread.  Returns false, having said why, if no thread can have
+// them; threads that cannot are left out of the figures.
+bool startProfiling() {
+#ifdef _OPENMP
+	profileThreads = omp_get_max_threads();
+#else
+	profileThreads = 1;
+#endif
+	profileFds = (int*)malloc(profileThreads * PROFILE_EVENTS * sizeof(int));
+	profileSlots = (int*)malloc(profileThreads * PROFILE_EVENTS * sizeof(int));
+	for (int i = 0; i < profileThreads * PROFILE_EVENTS; i++) {
+		profileFds[i] = -1;
+		profileSlots[i] = -1;
+	}
+	profileKernelCount = 0;
+	
+	int failure = 0;
+	int failedThreads = 0;
+#ifdef _OPENMP
+#pragma omp parallel
+	{
+		int error = openProfileCounters(omp_get_thread_num());
+		if (error != 0) {
+#pragma omp critical(profile)
+			{
+				failure = error;
+				failedThreads++;
+			}
+		}
+	}
+#else
+	failure = openProfileCounters(0);
+	failedThreads = failure != 0 ? 1 : 0;
+#endif
+	if (failedThreads > 0 && failedThreads < profileThreads) {
+		printf("\n--profile: %d of %d threads cannot count (%s); their share of the work is left out.\n",
+			failedThreads, profileThreads, strerror(failure));
+		return true;
+	}
+	if (failure != 0) {
+		printf("\n--profile: hardware counters are not available here (%s).\n", strerror(failure));
+		if (failure == EACCES || failure == EPERM)
+			printf("Lowering /proc/sys/kernel/perf_event_paranoid to 2 or below may help.\n");
+		else if (failure == ENOENT || failure == EOPNOTSUPP)
+			printf("The processor's counters are not exposed to this system, as is common in virtual machines.\n");
+		closeProfileCounters();
+		return false;
+	}
+	return true;
+}
+
+// Reads every thread's counters, scaled up for any time the group had to share the hardware
+void readProfileCounters(unsigned long long* values) {
+#if defined(__linux__)
+	for (int t = 0; t < profileThreads; t++) {
+		unsigned long long reading[3 + PROFILE_EVENTS]; // count, time enabled, time running, values
+		bool valid = profileFds[t * PROFILE_EVENTS] >= 0 && read(profileFds[t * PROFILE_EVENTS], reading, sizeof(reading)) >= (ssize_t)(3 * sizeof(unsigned long long));
+		double scale = valid && reading[2] > 0 ? (double)reading[1] / reading[2] : 0;
+		for (int e = 0; e < PROFILE_EVENTS; e++) {
+			int slot = profileSlots[t * PROFILE_EVENTS + e];
+			values[t * PROFILE_EVENTS + e] = slot >= 0 && (unsigned long long)slot < reading[0] ? (unsigned long long)(reading[3 + slot] * scale) : 0;
+		}
+	}
+#endif
+}
+
+// Charges the counts between its construction and destruction to the named kernel
+class KernelProfile {
+public:
+	KernelProfile(const char* kernel, unsigned long long pixels);
+	~KernelProfile();
+	
+private:
+	const char* name;
+	unsigned long long pixelCount;
+	unsigned long long* start; // NULL when not profiling
+};
+
+KernelProfile::KernelProfile(const char* kernel, unsigned long long pixels) {
+	name = kernel;
+	pixelCount = pixels;
+	start = NULL;
+	if (!profiling)
+		return;
+	start = (unsigned long long*)malloc(profileThreads * PROFILE_EVENTS * sizeof(unsigned long long));
+	readProfileCounters(start);
+}
+
+KernelProfile::~KernelProfile() {
+	if (start == NULL)
+		return;
+	unsigned long long* end = (unsigned long long*)malloc(profileThreads * PROFILE_EVENTS * sizeof(unsigned long long));
+	readProfileCounters(end);
+	
+#pragma omp critical(profile)
+	{
+		KernelCounters* kernel = NULL;
+		for (int k = 0; k < profileKernelCount && kernel == NULL; k++)
+			if (strcmp(profileKernels[k]->name, name) == 0)
+				kernel = profileKernels[k];
+		if (kernel == NULL && profileKernelCount < PROFILE_MAX_KERNELS) {
+			kernel = (KernelCounters*)calloc(1, sizeof(KernelCounters) + profileThreads * PROFILE_EVENTS * sizeof(unsigned long long));
+			snprintf(kernel->name, sizeof(kernel->name), "%s", name);
+			profileKernels[profileKernelCount++] = kernel;
+		}
+		if (kernel != NULL) {
+			kernel->calls++;
+			kernel->pixels += pixelCount;
+			for (int i = 0; i < profileThreads * PROFILE_EVENTS; i++)
+				kernel->counts[i] += end[i] > start[i] ? end[i] - start[i] : 0;
+		}
+	}
+	free(start);
+	free(end);
+}
+
+// Prints count / units to a column, or n/a for an event this machine does not count
+void printProfileRatio(int width, int precision, unsigned long long count, double units, bool available) {
+	if (available && units > 0)
+		printf(" %*.*f", width, precision, count / units);
+	else
+		printf(" %*s", width, "n/a");
+}
+
+// Per-pixel and per-block figures for each kernel, then how its work fell on the threads.
+// An event is shown if any thread counts it; its totals are over the threads that do.
+void printProfile() {
+	int counting[PROFILE_EVENTS] = { 0, 0, 0, 0, 0 };
+	bool available[PROFILE_EVENTS];
+	for (int e = 0; e < PROFILE_EVENTS; e++) {
+		for (int t = 0; t < profileThreads; t++)
+			if (profileSlots[t * PROFILE_EVENTS + e] >= 0)
+				counting[e]++;
+		available[e] = counting[e] > 0;
+	}
+	
+	printf("\nHardware counters by kernel (a block is 4x4 pixels; MPKI is misses per thousand instructions):\n");
+	printf("Threads counting, of %d: cycles %d, instructions %d, L1D misses %d, LLC misses %d, branch misses %d\n", profileThreads,
+		counting[PROFILE_CYCLES], counting[PROFILE_INSTRUCTIONS], counting[PROFILE_L1D_MISSES], counting[PROFILE_LLC_MISSES],
+		counting[PROFILE_BRANCH_MISSES]);
+	printf("%-32s %6s %10s %9s %9s %6s %9s %9s %9s\n", "kernel", "calls", "pixels", "cycles/px", "instr/px", "IPC",
+		"L1D/blk", "LLC/blk", "br/blk");
+	for (int k = 0; k < profileKernelCount; k++) {
+		KernelCounters* kernel = profileKernels[k];
+		unsigned long long total[PROFILE_EVENTS] = { 0, 0, 0, 0, 0 };
+		for (int t = 0; t < profileThreads; t++)
+			for (int e = 0; e < PROFILE_EVENTS; e++)
+				total[e] += kernel->counts[t * PROFILE_EVENTS + e];
+		double pixels = (double)kernel->pixels;
+		
+		printf("%-32s %6llu %10llu", kernel->name, kernel->calls, kernel->pixels);
+		printProfileRatio(9, 2, total[PROFILE_CYCLES], pixels, available[PROFILE_CYCLES]);
+		printProfileRatio(9, 2, total[PROFILE_INSTRUCTIONS], pixels, available[PROFILE_INSTRUCTIONS]);
+		printProfileRatio(6, 2, total[PROFILE_INSTRUCTIONS], (double)total[PROFILE_CYCLES], available[PROFILE_INSTRUCTIONS]);
+		printProfileRatio(9, 3, total[PROFILE_L1D_MISSES], pixels / 16, available[PROFILE_L1D_MISSES]);
+		printProfileRatio(9, 3, total[PROFILE_LLC_MISSES], pixels / 16, available[PROFILE_LLC_MISSES]);
+		printProfileRatio(9, 3, total[PROFILE_BRANCH_MISSES], pixels / 16, available[PROFILE_BRANCH_MISSES]);
+		printf("\n");
+		
+		for (int t = 0; t < profileThreads; t++) {
+			unsigned long long* counts = kernel->counts + t * PROFILE_EVENTS;
+			int* slots = profileSlots + t * PROFILE_EVENTS;
+			if (counts[PROFILE_CYCLES] == 0)
+				continue;
+			double thousands = counts[PROFILE_INSTRUCTIONS] / 1000.0;
+			printf("\tthread %-3d %5.1f%% of cycles, IPC", t, total[PROFILE_CYCLES] > 0 ? 100.0 * counts[PROFILE_CYCLES] / total[PROFILE_CYCLES] : 0);
+			printProfileRatio(5, 2, counts[PROFILE_INSTRUCTIONS], (double)counts[PROFILE_CYCLES], slots[PROFILE_INSTRUCTIONS] >= 0);
+			printf(", MPKI L1D");
+			printProfileRatio(7, 3, counts[PROFILE_L1D_MISSES], thousands, slots[PROFILE_L1D_MISSES] >= 0 && slots[PROFILE_INSTRUCTIONS] >= 0);
+			printf(" LLC");
+			printProfileRatio(7, 3, counts[PROFILE_LLC_MISSES], thousands, slots[PROFILE_LLC_MISSES] >= 0 && slots[PROFILE_INSTRUCTIONS] >= 0);
+			printf(" branch");
+			printProfileRatio(7, 3, counts[PROFILE_BRANCH_MISSES], thousands, slots[PROFILE_BRANCH_MISSES] >= 0 && slots[PROFILE_INSTRUCTIONS] >= 0);
+			printf("\n");
+		}
+	}
+	if (profileKernelCount == 0)
+		printf("\tNo kernels ran.\n");
+	
+	closeProfileCounters();
+	for (int k = 0; k < profileKernelCount; k++)
+		free(profileKernels[k]);
+	free(profileFds);
+	free(profileSlots);
+}
+
+// What --auto and the 16-bit layout choice know about a whole image
+struct ImageStats {
+	bool opaque;
+	bool binaryAlpha;
+	unsigned int alphaErrorDXT3;
+	unsigned int alphaErrorDXT5;
+	unsigned int colorError; // average over blocks
+};
+
+// Everything about one file being converted; several jobs can run at once
+class ConversionJob {
+public:
+	// This section defines various buffers and files used
+	const char* filename;
+	const char* outputPath; // where the result goes, NULL for next to the input
+	const JobOptions* options;
+	FILE* bmpFile;
+	FILE* streamOutput; // where output named "-" is written
+	bool inputIsStream; // read from standard input, held in streamBuffer
+	unsigned char* streamBuffer; // the whole input when it is held in memory: standard input, a daemon payload or a file read ahead
+	unsigned int inputPosition; // bytes of the input consumed so far; pipes cannot ftell
+	unsigned char* inputFileBuffer;
+	unsigned char* outputFileBuffer;
+	unsigned char* outputHeaderBuffer;
+	
+	// ints holding input and output file type
+	int inputFileType;
+	int outputFileType;
+	int inputContainer;
+	int outputContainer;
+	int outputTransform;
+	bool autoOutput; // outputFileType is picked from the image once it is read
+	int outputLayout; // for 16-bit output
+	bool outputDither;
+	bool normalMap; // DXT5nm output: X in alpha, Y in green
+	
+	// variables holding image properties
+	unsigned int width;
+	unsigned int height;
+	unsigned int inputFileSize;
+	unsigned int outputFileSize;
+	unsigned int inputHeaderSize;
+	unsigned int inputBufferSize;
+	unsigned int outputHeaderSize;
+	unsigned int outputBufferSize;
+	unsigned int inputPayloadSize; // top level image plus any mip levels following it
+	unsigned int inputDataOffset; // where the payload starts in the input file
+	unsigned int inputMipLevels; // number of levels in the input payload, including the top level
+	unsigned int outputMipLevels;
+	
+	// For 16-bit with mask
+	unsigned int bitmask_red;
+	unsigned int bitmask_green;
+	unsigned int bitmask_blue;
+	unsigned int bitmask_alpha;
+	
+	// For indexed colour: 1, 4 or 8 bits an index, rows padded to 4 bytes, and the colour table as BGRA
+	unsigned int indexBits;
+	unsigned int indexStride;
+	unsigned char colorTable[256][4];
+	
+	bool mips;
+	bool fsHeader; // the bitmap carries an FS70 block
+	bool tiledInput; // inputFileBuffer holds 32-bit pixels a 4x4 block per 64 bytes, as shrinkInput leaves them
+	
+	// Messages about this file, printed together so concurrent jobs do not interleave
+	char* reportBuffer;
+	size_t reportLength;
+	size_t reportCapacity;
+	int replySocket; // daemon client the messages go to instead of the console, -1 if none
+	
+	ConversionJob();
+	~ConversionJob();
+	
+	void report(const char* format, ...);
+	void flushReport();
+	
+	unsigned int blockGrain();
+	unsigned int rowGrain();
+	
+	unsigned int mipChainSize(int fileType, unsigned int levels);
+	unsigned int countMipLevels(int fileType, unsigned int available, unsigned int maxLevels);
+	bool openInput(const char* name, bool headersOnly);
+	int getByte();
+	unsigned short getLittleEndianShort();
+	unsigned int getLittleEndianInt();
+	
+	int processDDSInput();
+	void transformPayload(unsigned char* buffer, int fileType, unsigned int levels, int transform);
+	int processFileInput();
+	int readInputPayload();
+	
+	void expand_24_to_32_in_place(unsigned char* buffer);
+	void compact_32_to_24_in_place(unsigned char* buffer);
+	void decode_mask16_pixel(unsigned short pixelValue, unsigned char* to);
+	unsigned char* indexedColor(unsigned char* from, unsigned int x, unsigned int y);
+	template <class Source, class Dest> bool conv_fused(unsigned char* from, unsigned char* to);
+	template <class Dest> bool conv_fused_from_input(unsigned char* from, unsigned char* to);
+	
+	void makeOutputHeader_FS_dxt(int fileType);
+	void makeOutputHeader_FS_32();
+	void makeOutputHeader_STD_24();
+	void makeOutputHeader_STD_32();
+	void makeOutputHeader_DDS();
+	void makeOutputHeader_MASK_16();
+	
+	template <class Source> void averageBlock(unsigned char* from, unsigned int i, unsigned int x_coord, unsigned int y_coord, unsigned char* to);
+	template <class Source> bool conv_preview(unsigned char* from, unsigned char* to);
+	bool conv_preview_from_input(unsigned char* from, unsigned char* to);
+	bool makePreview(unsigned int maxSize);
+	bool needsShrink();
+	bool shrinkInput(unsigned int maxSize);
+	
+	void analyzeImage(ImageStats* result);
+	int chooseOutputType();
+	int chooseLayout();
+	bool canConvertInPlace();
+	bool convertInPlace();
+	bool convertFusedToOutput();
+	bool canRewrap();
+	bool rewrapToOutput();
+	bool canCopyPayload();
+	bool copyPayloadToOutput(const char* outputFilename);
+	bool writeOutputFile(unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize);
+	bool saveOutputFile(const char* outputFilename);
+	bool saveBuffers(const char* outputFilename, unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize);
+	unsigned char* readOriginalFile();
+	bool copyOriginalToOutput(const char* outputFilename);
+	bool addToBundle(const char* name, unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize,
+		int fileType, int container, unsigned int levels, bool fs70);
+	bool addOriginalToBundle();
+	
+	bool load(const char* name);
+	unsigned long long peakFootprint();
+	int selectOutput(char selection);
+	bool convert();
+	bool writePreview(unsigned int maxSize);
+	char* inspect(const char* name);
+	char* inspectRecord(const char* error, unsigned int dataOffset);
+};
 
 void bufferWriteLittleEndianLong(unsigned char* fileBuffer, unsigned int index, unsigned long long value) {
 	fileBuffer[index] = (unsigned char)(value & 0x000000ff);
@@ -122,18 +606,309 @@ unsigned long long bufferReadLittleEndianLong(unsigned char* fileBuffer, unsigne
 	    + ((unsigned long long)fileBuffer[index + 7] << 56);
 }
 
-unsigned short getLittleEndianShort() {
+#if !defined(_WIN32) && !defined(WIN32)
+// --daemon talks to its clients in records: a type byte, a little-endian length and the data.
+// 'M' carries messages, 'D' the image written to "-" and 'E' ends a request with the number
+// of files that failed.  A request is a length-prefixed block holding the client's working
+// directory and arguments, each NUL-terminated, then the length and bytes of the client's
+// standard input (none unless one of the files is "-").
+bool readFully(int fd, void* buffer, size_t length) {
+	unsigned char* to = (unsigned char*)buffer;
+	while (length > 0) {
+		ssize_t got = read(fd, to, length);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		to += got;
+		length -= got;
+	}
+	return true;
+}
+
+bool writeFully(int fd, const void* buffer, size_t length) {
+	const unsigned char* from = (const unsigned char*)buffer;
+	while (length > 0) {
+		ssize_t put = write(fd, from, length);
+		if (put < 0 && errno == EINTR)
+			continue;
+		if (put <= 0)
+			return false;
+		from += put;
+		length -= put;
+	}
+	return true;
+}
+
+bool sendRecord(int fd, char type, const void* data, unsigned int length) {
+	unsigned char header[5];
+	header[0] = (unsigned char)type;
+	bufferWriteLittleEndianInt(header, 1, length);
+	return writeFully(fd, header, 5) && writeFully(fd, data, length);
+}
+#endif
+
+bool isBlockCompressed(int fileType) {
+	return fileType >= FS_DXT1 && fileType <= FS_DXT5;
+}
+
+// Size in bytes of one image level of the given type and dimensions
+unsigned int levelSize(int fileType, unsigned int levelWidth, unsigned int levelHeight) {
+	unsigned int blocks = ((levelWidth + 3) >> 2) * ((levelHeight + 3) >> 2);
+	switch (fileType) {
+	case FS_DXT1:
+	case FS_DXT1A:
+		return blocks * 8;
+	case FS_DXT3:
+	case FS_DXT5:
+		return blocks * 16;
+	case STD_24:
+		return levelWidth * levelHeight * 3;
+	case STD_32:
+	case FS_32:
+		return levelWidth * levelHeight * 4;
+	case STD_16:
+	case MASK_16:
+		return levelWidth * levelHeight * 2;
+	default:
+		return 0;
+	}
+}
+
+// Payload buffers of finished files, kept for the next ones.  Large allocations come straight
+// from mmap and fault in every page on first touch, while a recycled buffer is already mapped.
+// Every inputFileBuffer and outputFileBuffer comes from allocBuffer.
+#define POOL_SLOTS 4
+#define POOL_MIN_BYTES ((size_t)1 << 20) // smaller buffers are cheap to get from malloc
+#define POOL_MAX_BYTES ((size_t)256 << 20)
+#define BUFFER_HEADER 64 // the capacity is kept in front of the data, which stays aligned
+
+unsigned char* bufferPool[POOL_SLOTS];
+int bufferPoolCount = 0;
+size_t bufferPoolBytes = 0;
+
+size_t bufferCapacity(unsigned char* buffer) {
+	return *(size_t*)(buffer - BUFFER_HEADER);
+}
+
+unsigned char* allocBuffer(size_t size) {
+	unsigned char* buffer = NULL;
+	if (size >= POOL_MIN_BYTES) {
+#pragma omp critical(bufferPool)
+		{
+			// the smallest pooled buffer that fits, unless it would waste more than half
+			int best = -1;
+			for (int i = 0; i < bufferPoolCount; i++) {
+				size_t capacity = bufferCapacity(bufferPool[i]);
+				if (capacity >= size && capacity <= size * 2 && (best < 0 || capacity < bufferCapacity(bufferPool[best])))
+					best = i;
+			}
+			if (best >= 0) {
+				buffer = bufferPool[best];
+				bufferPoolBytes -= bufferCapacity(buffer);
+				bufferPool[best] = bufferPool[--bufferPoolCount];
+			}
+		}
+	}
+	if (buffer != NULL)
+		return buffer;
+	
+	unsigned char* block = (unsigned char*)malloc(size + BUFFER_HEADER);
+	if (block == NULL)
+		return NULL;
+	*(size_t*)block = size;
+	return block + BUFFER_HEADER;
+}
+
+// Gives a buffer back to the pool, or to the system if the pool is full.  The pool stays
+// within a quarter of --mem-budget, since the budget does not count it.
+void releaseBuffer(unsigned char* buffer) {
+	if (buffer == NULL)
+		return;
+	size_t capacity = bufferCapacity(buffer);
+	size_t limit = memBudget > 0 && memBudget / 4 < POOL_MAX_BYTES ? (size_t)(memBudget / 4) : POOL_MAX_BYTES;
+	bool kept = false;
+	if (capacity >= POOL_MIN_BYTES) {
+#pragma omp critical(bufferPool)
+		{
+			if (bufferPoolCount < POOL_SLOTS && bufferPoolBytes + capacity <= limit) {
+				bufferPool[bufferPoolCount++] = buffer;
+				bufferPoolBytes += capacity;
+				kept = true;
+			}
+		}
+	}
+	if (!kept)
+		free(buffer - BUFFER_HEADER);
+}
+
+// Makes room for `size` bytes, keeping the contents; NULL if there is no memory
+unsigned char* growBuffer(unsigned char* buffer, size_t size) {
+	if (bufferCapacity(buffer) >= size)
+		return buffer;
+	unsigned char* block = (unsigned char*)realloc(buffer - BUFFER_HEADER, size + BUFFER_HEADER);
+	if (block == NULL)
+		return NULL;
+	*(size_t*)block = size;
+	return block + BUFFER_HEADER;
+}
+
+ConversionJob::ConversionJob() {
+	filename = NULL;
+	outputPath = NULL;
+	options = &jobOptions;
+	bmpFile = NULL;
+	streamOutput = dataOutput;
+	inputIsStream = false;
+	streamBuffer = NULL;
+	inputPosition = 0;
+	inputFileBuffer = NULL;
+	outputFileBuffer = NULL;
+	outputHeaderBuffer = NULL;
+	inputFileType = UNKN;
+	outputFileType = UNKN;
+	inputContainer = CONT_BMP;
+	outputContainer = CONT_BMP;
+	outputTransform = XFORM_NONE;
+	autoOutput = false;
+	outputLayout = LAYOUT_AUTO;
+	outputDither = false;
+	normalMap = false;
+	width = 0;
+	height = 0;
+	inputFileSize = 0;
+	outputFileSize = 0;
+	inputHeaderSize = 0;
+	inputBufferSize = 0;
+	outputHeaderSize = 0;
+	outputBufferSize = 0;
+	inputPayloadSize = 0;
+	inputDataOffset = 0;
+	inputMipLevels = 1;
+	outputMipLevels = 1;
+	bitmask_red = 0;
+	bitmask_green = 0;
+	bitmask_blue = 0;
+	bitmask_alpha = 0;
+	indexBits = 0;
+	indexStride = 0;
+	mips = false;
+	fsHeader = false;
+	tiledInput = false;
+	reportBuffer = NULL;
+	reportLength = 0;
+	reportCapacity = 0;
+	replySocket = -1;
+}
+
+ConversionJob::~ConversionJob() {
+	if (bmpFile != NULL)
+		fclose(bmpFile);
+	if (streamBuffer != NULL)
+		free(streamBuffer);
+	releaseBuffer(inputFileBuffer);
+	releaseBuffer(outputFileBuffer);
+	if (outputHeaderBuffer != NULL)
+		free(outputHeaderBuffer);
+	flushReport();
+	free(reportBuffer);
+}
+
+void ConversionJob::report(const char* format, ...) {
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length < 0)
+		return;
+	if (length >= (int)sizeof(line))
+		length = sizeof(line) - 1;
+	
+	if (reportLength + length + 1 > reportCapacity) {
+		reportCapacity = (reportLength + length + 1) * 2;
+		reportBuffer = (char*)realloc(reportBuffer, reportCapacity);
+	}
+	memcpy(reportBuffer + reportLength, line, length + 1);
+	reportLength += length;
+}
+
+void ConversionJob::flushReport() {
+	if (reportLength == 0)
+		return;
+#if !defined(_WIN32) && !defined(WIN32)
+	if (replySocket >= 0) {
+		sendRecord(replySocket, 'M', reportBuffer, (unsigned int)reportLength);
+		reportLength = 0;
+		return;
+	}
+#endif
+#pragma omp critical(console)
+	{
+		fputs(reportBuffer, stdout);
+		fflush(stdout);
+	}
+	reportLength = 0;
+}
+
+// Blocks per chunk of parallel work: whole block rows covering about CHUNK_BYTES of 32-bit pixels,
+// so a 64x64 icon is one chunk while a 4096x4096 texture is split 256 ways
+unsigned int ConversionJob::blockGrain() {
+	unsigned int blockRows = CHUNK_BYTES / (width << 4);
+	if (blockRows == 0)
+		blockRows = 1;
+	return blockRows * (width >> 2);
+}
+
+// Pixel rows per chunk of parallel work, matching blockGrain
+unsigned int ConversionJob::rowGrain() {
+	return (blockGrain() / (width >> 2)) << 2;
+}
+
+// Size in bytes of the first `levels` levels of a mip chain starting at width x height
+unsigned int ConversionJob::mipChainSize(int fileType, unsigned int levels) {
+	unsigned int size = 0;
+	unsigned int levelWidth = width;
+	unsigned int levelHeight = height;
+	for (unsigned int i = 0; i < levels; i++) {
+		size += levelSize(fileType, levelWidth, levelHeight);
+		if (levelWidth > 1)
+			levelWidth >>= 1;
+		if (levelHeight > 1)
+			levelHeight >>= 1;
+	}
+	return size;
+}
+
+// Number of complete mip levels that fit into `available` bytes, capped at `maxLevels`
+unsigned int ConversionJob::countMipLevels(int fileType, unsigned int available, unsigned int maxLevels) {
+	unsigned int levels = 0;
+	while (levels < maxLevels && mipChainSize(fileType, levels + 1) <= available) {
+		levels++;
+		if ((width >> (levels - 1)) <= 1 && (height >> (levels - 1)) <= 1)
+			break;
+	}
+	return levels;
+}
+
+// Next byte of the input, counted so that the parser never needs to seek
+int ConversionJob::getByte() {
+	inputPosition++;
+	return getc(bmpFile);
+}
+
+unsigned short ConversionJob::getLittleEndianShort() {
 	unsigned char intbuffer[2];
 	for (int i = 0; i < 2; i++) {
-		intbuffer[i] = (unsigned char)getc(bmpFile);
+		intbuffer[i] = (unsigned char)getByte();
 	}
 	return (unsigned short)intbuffer[0] + ((unsigned short)intbuffer[1] << 8);
 }
 
-unsigned int getLittleEndianInt() {
+unsigned int ConversionJob::getLittleEndianInt() {
 	unsigned char intbuffer[4];
 	for (int i = 0; i < 4; i++) {
-		intbuffer[i] = (unsigned char)getc(bmpFile);
+		intbuffer[i] = (unsigned char)getByte();
 	}
 	return (unsigned int)intbuffer[0] + ((unsigned int)intbuffer[1] << 8) + ((unsigned int)intbuffer[2] << 16) + ((unsigned int)intbuffer[3] << 24);
 }
@@ -148,10 +923,10 @@ unsigned short findMaxDistance(unsigned char* rgb, int size, int rAvg, int gAvg,
 	return distance;
 }
 
+void compress_dxt_color(unsigned char* rgb, unsigned char* to);
+
 // TODO: This function needs work
-unsigned char* compress_dxt3(unsigned char* rgb, unsigned char* alpha) {
-	unsigned char* to = (unsigned char*)malloc(16 * sizeof(unsigned char));
-	
+void compress_dxt3(unsigned char* rgb, unsigned char* alpha, unsigned char* to) {
 	// First 8 bytes are the Alpha
 	// Next 8 bytes are the RGB Compressed data
 	
@@ -170,6 +945,11 @@ unsigned char* compress_dxt3(unsigned char* rgb, unsigned char* alpha) {
 	}
 	bufferWriteLittleEndianLong(to, 0, value_a);
 	
+	compress_dxt_color(rgb, to + 8);
+}
+
+// Writes the 8-byte colour half of a DXT block (c0 >= c1, so four colours) for 16 BGR pixels
+void compress_dxt_color(unsigned char* rgb, unsigned char* to) {
 	// Compress RGB
 	//1. Calculate average, max distance, and difference relative to red;
 	
@@ -329,18 +1109,18 @@ unsigned char* compress_dxt3(unsigned char* rgb, unsigned char* alpha) {
 		r[3] = (r[0] + 2 * r[1]) / 3;
 		
 		for (int i = 0; i < 16; i++) {
-			mapTo[0] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - bb[0]), 2)
-								   + pow((double)(rgb[3 * i + 1] - gg[0]), 2)
-								   + pow((double)(rgb[3 * i + 2] - rr[0]), 2)));
-			mapTo[1] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - bb[1]), 2)
-								   + pow((double)(rgb[3 * i + 1] - gg[1]), 2)
-								   + pow((double)(rgb[3 * i + 2] - rr[1]), 2)));
-			mapTo[2] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - bb[2]), 2)
-								   + pow((double)(rgb[3 * i + 1] - gg[2]), 2)
-								   + pow((double)(rgb[3 * i + 2] - rr[2]), 2)));
-			mapTo[3] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - bb[3]), 2)
-								   + pow((double)(rgb[3 * i + 1] - gg[3]), 2)
-								   + pow((double)(rgb[3 * i + 2] - rr[3]), 2)));
+			mapTo[0] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - b[0]), 2)
+								   + pow((double)(rgb[3 * i + 1] - g[0]), 2)
+								   + pow((double)(rgb[3 * i + 2] - r[0]), 2)));
+			mapTo[1] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - b[1]), 2)
+								   + pow((double)(rgb[3 * i + 1] - g[1]), 2)
+								   + pow((double)(rgb[3 * i + 2] - r[1]), 2)));
+			mapTo[2] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - b[2]), 2)
+								   + pow((double)(rgb[3 * i + 1] - g[2]), 2)
+								   + pow((double)(rgb[3 * i + 2] - r[2]), 2)));
+			mapTo[3] = (unsigned long long)(10000 * sqrt(pow((double)(rgb[3 * i] - b[3]), 2)
+								   + pow((double)(rgb[3 * i + 1] - g[3]), 2)
+								   + pow((double)(rgb[3 * i + 2] - r[3]), 2)));
 			if (mapTo[0] <= mapTo[1])
 				tempA = 0;
 			else
@@ -362,21 +1142,205 @@ unsigned char* compress_dxt3(unsigned char* rgb, unsigned char* alpha) {
 		}
 	}
 	
-	bufferWriteLittleEndianShort(to, 8, c0);
-	bufferWriteLittleEndianShort(to, 10, c1);
-	bufferWriteLittleEndianInt(to, 12, mapping);
+	bufferWriteLittleEndianShort(to, 0, c0);
+	bufferWriteLittleEndianShort(to, 2, c1);
+	bufferWriteLittleEndianInt(to, 4, mapping);
+}
+
+// Reads a DDS file; bmpFile is positioned just after the leading 'D'
+int ConversionJob::processDDSInput() {
+	inputContainer = CONT_DDS;
+	
+// 1. Read DDS magic and header
+	
+	if (getByte() != 'D')
+		return 1;
+	if (getByte() != 'S')
+		return 1;
+	if (getByte() != ' ')
+		return 1;
+	
+	if (getLittleEndianInt() != 124)
+		return 1;
+	
+	unsigned int flags = getLittleEndianInt();
+	height = getLittleEndianInt();
+	width = getLittleEndianInt();
+	if (width != height)
+		return 4;
+	if (width < 4 || (width & (width - 1)) != 0)
+		return 5;
+	
+	// skip over pitch / linear size and depth
+	getLittleEndianInt();
+	getLittleEndianInt();
+	
+	unsigned int mipMapCount = getLittleEndianInt();
+	if ((flags & 0x20000) == 0 || mipMapCount == 0) // DDSD_MIPMAPCOUNT
+		mipMapCount = 1;
+	
+	// skip over reserved area
+	for (int i = 0; i < 11; i++)
+		getLittleEndianInt();
+	
+// 2. Read pixel format
+	
+	if (getLittleEndianInt() != 32)
+		return 1;
+	unsigned int pfFlags = getLittleEndianInt();
+	unsigned int fourCC = getLittleEndianInt();
+	unsigned int bitCount = getLittleEndianInt();
+	unsigned int maskRed = getLittleEndianInt();
+	unsigned int maskGreen = getLittleEndianInt();
+	unsigned int maskBlue = getLittleEndianInt();
+	getLittleEndianInt(); // alpha mask
+	
+	if (pfFlags & 0x4) { // DDPF_FOURCC
+		if (fourCC == 827611204) // DXT1
+			inputFileType = FS_DXT1;
+		else if (fourCC == 861165636) // DXT3
+			inputFileType = FS_DXT3;
+		else if (fourCC == 894720068) // DXT5
+			inputFileType = FS_DXT5;
+		else
+			return 1;
+	} else if (pfFlags & 0x40) { // DDPF_RGB
+		if (maskRed != 0x00ff0000 || maskGreen != 0x0000ff00 || maskBlue != 0x000000ff)
+			return 1;
+		if (bitCount == 32)
+			inputFileType = STD_32;
+		else if (bitCount == 24)
+			inputFileType = STD_24;
+		else
+			return 1;
+	} else {
+		return 1;
+	}
+	
+	// skip over caps and reserved
+	for (int i = 0; i < 5; i++)
+		getLittleEndianInt();
+	
+	inputHeaderSize = 128;
+	inputBufferSize = levelSize(inputFileType, width, height);
+	
+// 3. Test that data is not corrupt and work out how much of the mip chain is there.
+	if (inputHeaderSize + inputBufferSize > inputFileSize)
+		return 3;
+	
+	inputMipLevels = countMipLevels(inputFileType, inputFileSize - inputHeaderSize, mipMapCount);
+	inputPayloadSize = mipChainSize(inputFileType, inputMipLevels);
+	mips = inputMipLevels > 1;
+	
+	return 0;
+}
+
+// Rearranges the fields of a 4x4 index grid (fieldBits per pixel, row-major from bit 0).
+// Only the top-left rows x cols pixels are valid for levels smaller than a block; the rest stay put.
+unsigned long long transformIndices(unsigned long long bits, unsigned int fieldBits, unsigned int rows, unsigned int cols, int transform) {
+	unsigned long long mask = (1ull << fieldBits) - 1;
+	unsigned long long result = 0;
+	for (unsigned int row = 0; row < 4; row++) {
+		unsigned int toRow = row >= rows ? row : (transform & XFORM_FLIP) ? rows - 1 - row : row;
+		for (unsigned int col = 0; col < 4; col++) {
+			unsigned int toCol = (row >= rows || col >= cols) ? col : (transform & XFORM_MIRROR) ? cols - 1 - col : col;
+			unsigned long long field = (bits >> (((row << 2) + col) * fieldBits)) & mask;
+			result |= field << (((toRow << 2) + toCol) * fieldBits);
+		}
+	}
+	return result;
+}
+
+// Reorients the pixels inside one compressed block without decoding it
+void transformBlock(unsigned char* block, int fileType, unsigned int rows, unsigned int cols, int transform) {
+	unsigned int colorOffset = 0;
+	if (fileType == FS_DXT3) {
+		// 4-bit explicit alpha per pixel
+		bufferWriteLittleEndianLong(block, 0, transformIndices(bufferReadLittleEndianLong(block, 0), 4, rows, cols, transform));
+		colorOffset = 8;
+	} else if (fileType == FS_DXT5) {
+		// two alpha endpoints, then 3-bit alpha indices in 6 bytes
+		unsigned long long codes_a = bufferReadLittleEndianLong(block, 0) >> 16;
+		codes_a = transformIndices(codes_a, 3, rows, cols, transform);
+		for (int i = 0; i < 6; i++)
+			block[2 + i] = (unsigned char)((codes_a >> (i * 8)) & 0xff);
+		colorOffset = 8;
+	}
+	// 2-bit color indices after the two color endpoints
+	unsigned int codes = bufferReadLittleEndianInt(block, colorOffset + 4);
+	bufferWriteLittleEndianInt(block, colorOffset + 4, (unsigned int)transformIndices(codes, 2, rows, cols, transform));
+}
+
+// Flips and / or mirrors one image level in place: compressed data block by block, anything else pixel by pixel
+void transformLevel(unsigned char* level, int fileType, unsigned int levelWidth, unsigned int levelHeight, int transform) {
+	bool compressed = isBlockCompressed(fileType);
+	unsigned int unitBytes = compressed ? levelSize(fileType, 4, 4) : levelSize(fileType, 1, 1);
+	unsigned int unitsX = compressed ? (levelWidth + 3) >> 2 : levelWidth;
+	unsigned int unitsY = compressed ? (levelHeight + 3) >> 2 : levelHeight;
+	unsigned int rows = levelHeight < 4 ? levelHeight : 4;
+	unsigned int cols = levelWidth < 4 ? levelWidth : 4;
+	unsigned int grain = CHUNK_BYTES / (compressed ? 64 : 4);
 	
-	return to;
+PARALLEL_CHUNKS(grain)
+	for (int i = 0; i < (int)(unitsX * unitsY); i++) {
+		unsigned int x = i % unitsX;
+		unsigned int y = i / unitsX;
+		unsigned int toX = (transform & XFORM_MIRROR) ? unitsX - 1 - x : x;
+		unsigned int toY = (transform & XFORM_FLIP) ? unitsY - 1 - y : y;
+		unsigned int partner = toY * unitsX + toX;
+		
+		// every pair of units is handled once, by its lower index
+		if (partner < (unsigned int)i)
+			continue;
+		
+		unsigned char* a = level + i * unitBytes;
+		unsigned char* b = level + partner * unitBytes;
+		unsigned char temp;
+		for (unsigned int j = 0; j < unitBytes && a != b; j++) {
+			temp = a[j];
+			a[j] = b[j];
+			b[j] = temp;
+		}
+		if (compressed) {
+			transformBlock(a, fileType, rows, cols, transform);
+			if (a != b)
+				transformBlock(b, fileType, rows, cols, transform);
+		}
+	}
+}
+
+// Applies an orientation transform to every level of a mip chain
+void ConversionJob::transformPayload(unsigned char* buffer, int fileType, unsigned int levels, int transform) {
+	if (transform == XFORM_NONE)
+		return;
+	unsigned int levelWidth = width;
+	unsigned int levelHeight = height;
+	for (unsigned int i = 0; i < levels; i++) {
+		transformLevel(buffer, fileType, levelWidth, levelHeight, transform);
+		buffer += levelSize(fileType, levelWidth, levelHeight);
+		if (levelWidth > 1)
+			levelWidth >>= 1;
+		if (levelHeight > 1)
+			levelHeight >>= 1;
+	}
 }
 
-int processFileInput() {
+// Reads the headers only, leaving bmpFile at the start of the payload
+int ConversionJob::processFileInput() {
 	inputFileType = UNKN;
+	inputContainer = CONT_BMP;
+	mips = false;
+	fsHeader = false;
+	inputMipLevels = 1;
 	
 // 1. Read Bitmap File Header
 	
-	if (getc(bmpFile) != 'B')
+	int magic = getByte();
+	if (magic == 'D')
+		return processDDSInput();
+	if (magic != 'B')
 		return 1;
-	if (getc(bmpFile) != 'M')
+	if (getByte() != 'M')
 		return 1;
 	
 	unsigned int codedFileSize = getLittleEndianInt();
@@ -385,10 +1349,10 @@ int processFileInput() {
 		return 1;
 	
 	// skip over irrelevant stuff
-	getc(bmpFile);
-	getc(bmpFile);
-	getc(bmpFile);
-	getc(bmpFile);
+	getByte();
+	getByte();
+	getByte();
+	getByte();
 	
 	unsigned int startvalue = getLittleEndianInt();
 	
@@ -417,7 +1381,9 @@ int processFileInput() {
 			return 1;
 		
 		bitDepth = getLittleEndianShort();// var declared above
-		if (bitDepth == 16)
+		if (bitDepth == 1 || bitDepth == 4 || bitDepth == 8)
+			inputFileType = STD_INDEXED;
+		else if (bitDepth == 16)
 			inputFileType = STD_16;
 		else if (bitDepth == 24)
 			inputFileType = STD_24;
@@ -427,6 +1393,8 @@ int processFileInput() {
 			return 1;
 		
 		compression = getLittleEndianInt();// var declared above
+		if (inputFileType == STD_INDEXED && compression != 0) // run-length encoded
+			return 1;
 		if (compression == 827611204) // DXT1
 			inputFileType = FS_DXT1;
 		else if (compression == 861165636) // DXT3
@@ -447,8 +1415,14 @@ int processFileInput() {
 		getLittleEndianInt();
 		
 		palette = getLittleEndianInt();// var declared above
-		if (palette != 0)
+		if (inputFileType == STD_INDEXED) {
+			if (palette == 0)
+				palette = 1 << bitDepth;
+			if (palette > (1u << bitDepth))
+				return 1;
+		} else if (palette != 0) {
 			return 1;
+		}
 		
 		// skip over irrelevant stuff
 		getLittleEndianInt();
@@ -465,17 +1439,36 @@ int processFileInput() {
 			bitmask_green = getLittleEndianInt();
 			bitmask_blue = getLittleEndianInt();
 			bitmask_alpha = getLittleEndianInt();
-			printf("A:%08x R:%08x G:%08x B:%08x\n", bitmask_alpha, bitmask_red, bitmask_green, bitmask_blue);
+			report("A:%08x R:%08x G:%08x B:%08x\n", bitmask_alpha, bitmask_red, bitmask_green, bitmask_blue);
 		}
 	} else {
 	// OTHER HEADERS: WILL CODE LATER
 		return 1;
 	}
-	unsigned int currentIndex = (unsigned int)ftell(bmpFile);
+	
+	if (inputFileType == STD_INDEXED) {
+		// The colour table follows the header; indices past its end show as black
+		memset(colorTable, 0, sizeof(colorTable));
+		for (unsigned int i = 0; i < palette; i++) {
+			colorTable[i][0] = (unsigned char)getByte();
+			colorTable[i][1] = (unsigned char)getByte();
+			colorTable[i][2] = (unsigned char)getByte();
+			getByte();
+		}
+		for (unsigned int i = 0; i < 256; i++)
+			colorTable[i][3] = (unsigned char)0xff;
+		indexBits = bitDepth;
+		indexStride = ((width * indexBits + 31) >> 5) << 2;
+		inputBufferSize = indexStride * height;
+		while (inputPosition < startvalue)
+			getByte();
+	}
+	unsigned int currentIndex = inputPosition;
 	
 	if (currentIndex != startvalue) {
 // 3. Test if it is already a FS file format.
 		if (getLittleEndianInt() == 808932166) { // "FS70" in little endian
+			fsHeader = true;
 			if (bitDepth == 32)
 				inputFileType = FS_32;
 			if (getLittleEndianInt() != 20)
@@ -483,9 +1476,9 @@ int processFileInput() {
 			if (inputFileType < FS_32 || inputFileType > FS_DXT5)
 				return 2;
 			
-			getc(bmpFile);
+			getByte();
 			
-			char dxtType = getc(bmpFile);
+			char dxtType = getByte();
 			if (inputFileType == FS_DXT1) {
 				if (dxtType == 2)
 					inputFileType = FS_DXT1A;
@@ -500,7 +1493,7 @@ int processFileInput() {
 			if (getLittleEndianShort() != 0)
 				mips = true;
 			getLittleEndianInt();
-			currentIndex = (unsigned int)ftell(bmpFile);
+			currentIndex = inputPosition;
 		} else {
 			return 1;
 		}
@@ -510,573 +1503,3754 @@ int processFileInput() {
 	if (currentIndex + inputBufferSize > inputFileSize)
 		return 3;
 	
-// 5. OK so put file into Buffer.
-	inputFileBuffer = (unsigned char*)malloc(inputBufferSize * sizeof(unsigned char));
-	
-	for (unsigned int i = 0; i < inputBufferSize; i++) {
-		inputFileBuffer[i] = (unsigned char)getc(bmpFile);
+// 5. Mip levels, if any, follow the top level image.
+	inputPayloadSize = inputBufferSize;
+	if (mips) {
+		inputMipLevels = countMipLevels(inputFileType, inputFileSize - currentIndex, 32);
+		if (inputMipLevels > 1)
+			inputPayloadSize = mipChainSize(inputFileType, inputMipLevels);
+		else
+			inputMipLevels = 1;
 	}
 	
 	return 0;
 }
 
-bool conv_24_to_32(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)(width * height); i++) {
-		to[i * 4] = from[i * 3];
-		to[i * 4 + 1] = from[i * 3 + 1];
-		to[i * 4 + 2] = from[i * 3 + 2];
-		to[i * 4 + 3] = (char)0xff;
-	}
-	return true;
+// Puts the payload found by processFileInput into Buffer; the input file is not needed after this
+int ConversionJob::readInputPayload() {
+	// leave room for 24-bit input to grow into 32-bit where it lies
+	size_t capacity = inputPayloadSize;
+	if (canConvertInPlace() && levelSize(outputFileType, width, height) > capacity)
+		capacity = levelSize(outputFileType, width, height);
+	inputFileBuffer = allocBuffer(capacity);
+	if (inputFileBuffer == NULL)
+		return 3;
+	size_t payloadRead = fread(inputFileBuffer, 1, inputPayloadSize, bmpFile);
+	fclose(bmpFile);
+	bmpFile = NULL;
+	if (payloadRead != inputPayloadSize)
+		return 3;
+	
+	return 0;
 }
 
-bool conv_32_to_24(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)(width * height); i++) {
-		to[i * 3] = from[i * 4];
-		to[i * 3 + 1] = from[i * 4 + 1];
-		to[i * 3 + 2] = from[i * 4 + 2];
+// In-place 24/32-bit conversion.  Row y of the 32-bit image occupies [4wy, 4w(y+1)) and of the
+// 24-bit one [3wy, 3w(y+1)), so from row 4 on a row never overlaps its own old place, and rows
+// [a, b) with 3b <= 4a land only on rows outside [a, b) that are already done.  Those rows run
+// in parallel as one wave; the waves grow by a third each, and rows 0-3 go pixel by pixel.
+
+// Grows 24-bit pixels to 32 bits within a buffer of the 32-bit size, moving from the end forwards
+void ConversionJob::expand_24_to_32_in_place(unsigned char* buffer) {
+	KernelProfile profile("expand_24_to_32_in_place", (unsigned long long)width * height);
+	unsigned int end = height;
+	while (end > 4) {
+		unsigned int start = (end * 3 + 3) >> 2;
+		if (start < 4)
+			start = 4;
+PARALLEL_CHUNKS(rowGrain())
+		for (int y = (int)start; y < (int)end; y++) {
+			for (unsigned int i = y * width; i < (y + 1) * width; i++) {
+				buffer[(i << 2)] = buffer[i * 3];
+				buffer[(i << 2) + 1] = buffer[i * 3 + 1];
+				buffer[(i << 2) + 2] = buffer[i * 3 + 2];
+				buffer[(i << 2) + 3] = (char)0xff;
+			}
+		}
+		end = start;
+	}
+	for (int i = (int)(end * width) - 1; i >= 0; i--) {
+		unsigned char b = buffer[i * 3];
+		unsigned char g = buffer[i * 3 + 1];
+		unsigned char r = buffer[i * 3 + 2];
+		buffer[(i << 2)] = b;
+		buffer[(i << 2) + 1] = g;
+		buffer[(i << 2) + 2] = r;
+		buffer[(i << 2) + 3] = (char)0xff;
 	}
-	return true;
 }
 
-bool conv_mask16_to_32(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)(width * height); i++) {
-		unsigned short pixelValue = from[i * 2] + (from[i * 2 + 1] << 8);
-		
-		if (bitmask_blue != 0)
-			to[i * 4] = (char)(((pixelValue & bitmask_blue) / (1)) * 255 / (bitmask_blue / (1)));
-		else
-			to[i * 4] = (char)0x00;
-		
-		if (bitmask_green != 0)
-			to[i * 4 + 1] = (char)(((pixelValue & bitmask_green) / (bitmask_blue + 1)) * 255 / (bitmask_green / (bitmask_blue + 1)));
-		else
-			to[i * 4 + 1] = (char)0x00;
-		
-		if (bitmask_red != 0)
-			to[i * 4 + 2] = (char)(((pixelValue & bitmask_red) / (bitmask_green + bitmask_blue + 1)) * 255 / (bitmask_red / (bitmask_green + bitmask_blue + 1)));
-		else
-			to[i * 4 + 2] = (char)0x00;
-		
-		if (bitmask_alpha != 0)
-			to[i * 4 + 3] = (char)(((pixelValue & bitmask_alpha) / (bitmask_red + bitmask_green + bitmask_blue + 1)) * 255 / (bitmask_alpha / (bitmask_red + bitmask_green + bitmask_blue + 1)));
-		else
-			to[i * 4 + 3] = (char)0xff;
+// Drops the alpha byte of 32-bit pixels, packing them towards the start of the buffer
+void ConversionJob::compact_32_to_24_in_place(unsigned char* buffer) {
+	KernelProfile profile("compact_32_to_24_in_place", (unsigned long long)width * height);
+	unsigned int start = height < 4 ? height : 4;
+	for (unsigned int i = 0; i < start * width; i++) {
+		buffer[i * 3] = buffer[i << 2];
+		buffer[i * 3 + 1] = buffer[(i << 2) + 1];
+		buffer[i * 3 + 2] = buffer[(i << 2) + 2];
 	}
-	return true;
+	while (start < height) {
+		unsigned int end = (start << 2) / 3;
+		if (end > height)
+			end = height;
+PARALLEL_CHUNKS(rowGrain())
+		for (int y = (int)start; y < (int)end; y++) {
+			for (unsigned int i = y * width; i < (y + 1) * width; i++) {
+				buffer[i * 3] = buffer[i << 2];
+				buffer[i * 3 + 1] = buffer[(i << 2) + 1];
+				buffer[i * 3 + 2] = buffer[(i << 2) + 2];
+			}
+		}
+		start = end;
+	}
+}
+
+void ConversionJob::decode_mask16_pixel(unsigned short pixelValue, unsigned char* to) {
+	if (bitmask_blue != 0)
+		to[0] = (char)(((pixelValue & bitmask_blue) / (1)) * 255 / (bitmask_blue / (1)));
+	else
+		to[0] = (char)0x00;
+	
+	if (bitmask_green != 0)
+		to[1] = (char)(((pixelValue & bitmask_green) / (bitmask_blue + 1)) * 255 / (bitmask_green / (bitmask_blue + 1)));
+	else
+		to[1] = (char)0x00;
+	
+	if (bitmask_red != 0)
+		to[2] = (char)(((pixelValue & bitmask_red) / (bitmask_green + bitmask_blue + 1)) * 255 / (bitmask_red / (bitmask_green + bitmask_blue + 1)));
+	else
+		to[2] = (char)0x00;
+	
+	if (bitmask_alpha != 0)
+		to[3] = (char)(((pixelValue & bitmask_alpha) / (bitmask_red + bitmask_green + bitmask_blue + 1)) * 255 / (bitmask_alpha / (bitmask_red + bitmask_green + bitmask_blue + 1)));
+	else
+		to[3] = (char)0xff;
+}
+
+void decode_16_pixel(unsigned short pixelValue, unsigned char* to) {
+	to[0] = (char)((pixelValue & 0x1f) * 255 / 31);
+	pixelValue >>= 5;
+	
+	to[1] = (char)((pixelValue & 0x1f) * 255 / 31);
+	pixelValue >>= 5;
+	
+	to[2] = (char)((pixelValue & 0x1f) * 255 / 31);
+	to[3] = (char)0xff;
 }
 
-bool conv_16_to_32(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)(width * height); i++) {
-		unsigned short pixelValue = from[i * 2] + (from[i * 2 + 1] << 8);
+// The block decoders below write 4 rows of 4 BGRA pixels, rowStride bytes apart
+
+void decode_dxt1_block(unsigned char* from, unsigned char* to, unsigned int rowStride, bool alpha) {
+	unsigned short c0 = bufferReadLittleEndianShort(from, 0);
+	unsigned short c1 = bufferReadLittleEndianShort(from, 2);
+	unsigned int codes_rgba = bufferReadLittleEndianInt(from, 4);
+	
+	unsigned char a[4];
+	unsigned char b[4];
+	unsigned char g[4];
+	unsigned char r[4];
+	
+	a[0] = (unsigned char)0xff;
+	a[1] = (unsigned char)0xff;
+	a[2] = (unsigned char)0xff;
+	a[3] = (unsigned char)0xff;
+	
+	b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
+	g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
+	r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
+	
+	b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
+	g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
+	r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
+	
+	if (c0 > c1) {
+		b[2] = (2 * b[0] + b[1]) / 3;
+		g[2] = (2 * g[0] + g[1]) / 3;
+		r[2] = (2 * r[0] + r[1]) / 3;
 		
-		to[i * 4] = (char)((pixelValue & 0x1f) * 255 / 31);
-		pixelValue >>= 5;
+		b[3] = (b[0] + 2 * b[1]) / 3;
+		g[3] = (g[0] + 2 * g[1]) / 3;
+		r[3] = (r[0] + 2 * r[1]) / 3;
+	} else {
+		b[2] = (b[0] + b[1]) / 2;
+		g[2] = (g[0] + g[1]) / 2;
+		r[2] = (r[0] + r[1]) / 2;
 		
-		to[i * 4 + 1] = (char)((pixelValue & 0x1f) * 255 / 31);
-		pixelValue >>= 5;
+		b[3] = (unsigned char)0x00;
+		g[3] = (unsigned char)0x00;
+		r[3] = (unsigned char)0x00;
 		
-		to[i * 4 + 2] = (char)((pixelValue & 0x1f) * 255 / 31);
-		to[i * 4 + 3] = (char)0xff;
+		if (alpha)
+			a[3] = (unsigned char)0x00;
+	}
+	
+	unsigned int index, pixel_rgba;
+	
+	for (unsigned int row = 0; row < 4; row++) {
+		for (unsigned int col = 0; col < 4; col++) {
+			index = (row * rowStride) + (col << 2);
+			
+			pixel_rgba = codes_rgba & 0x3;
+			
+			to[index] = b[pixel_rgba];
+			to[index + 1] = g[pixel_rgba];
+			to[index + 2] = r[pixel_rgba];
+			to[index + 3] = a[pixel_rgba];
+			
+			codes_rgba >>= 2;
+		}
 	}
-	return true;
 }
 
-bool conv_dxt1_to_32(unsigned char* from, unsigned char* to, bool alpha = false) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)((width * height) >> 4); i++) {
-		unsigned short c0 = bufferReadLittleEndianShort(from, i * 8);
-		unsigned short c1 = bufferReadLittleEndianShort(from, i * 8 + 2);
-		unsigned int codes_rgba = bufferReadLittleEndianInt(from, i * 8 + 4);
-		
-		unsigned int x_coord = (i % (width >> 2)) << 2;
-		unsigned int y_coord = ((i << 2) / width) << 2;
-		
-		unsigned char a[4];
-		unsigned char b[4];
-		unsigned char g[4];
-		unsigned char r[4];
-		
-		a[0] = (unsigned char)0xff;
-		a[1] = (unsigned char)0xff;
-		a[2] = (unsigned char)0xff;
-		a[3] = (unsigned char)0xff;
-		
-		b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
-		g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
-		r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
-		
-		b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
-		g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
-		r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
-		
-		if (c0 > c1) {
-			b[2] = (2 * b[0] + b[1]) / 3;
-			g[2] = (2 * g[0] + g[1]) / 3;
-			r[2] = (2 * r[0] + r[1]) / 3;
+void decode_dxt3_block(unsigned char* from, unsigned char* to, unsigned int rowStride) {
+	unsigned long long vals_a = bufferReadLittleEndianLong(from, 0);
+	unsigned short c0 = bufferReadLittleEndianShort(from, 8);
+	unsigned short c1 = bufferReadLittleEndianShort(from, 10);
+	unsigned int codes_rgb = bufferReadLittleEndianInt(from, 12);
+	
+	unsigned char b[4];
+	unsigned char g[4];
+	unsigned char r[4];
+	
+	b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
+	g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
+	r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
+	
+	b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
+	g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
+	r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
+	
+	b[2] = (2 * b[0] + b[1]) / 3;
+	g[2] = (2 * g[0] + g[1]) / 3;
+	r[2] = (2 * r[0] + r[1]) / 3;
+	
+	b[3] = (b[0] + 2 * b[1]) / 3;
+	g[3] = (g[0] + 2 * g[1]) / 3;
+	r[3] = (r[0] + 2 * r[1]) / 3;
+	
+	unsigned int index, pixel_rgb;
+	
+	for (unsigned int row = 0; row < 4; row++) {
+		for (unsigned int col = 0; col < 4; col++) {
+			index = (row * rowStride) + (col << 2);
 			
-			b[3] = (b[0] + 2 * b[1]) / 3;
-			g[3] = (g[0] + 2 * g[1]) / 3;
-			r[3] = (r[0] + 2 * r[1]) / 3;
-		} else {
-			b[2] = (b[0] + b[1]) / 2;
-			g[2] = (g[0] + g[1]) / 2;
-			r[2] = (r[0] + r[1]) / 2;
+			pixel_rgb = codes_rgb & 0x3;
 			
-			b[3] = (unsigned char)0x00;
-			g[3] = (unsigned char)0x00;
-			r[3] = (unsigned char)0x00;
+			to[index] = b[pixel_rgb];
+			to[index + 1] = g[pixel_rgb];
+			to[index + 2] = r[pixel_rgb];
+			to[index + 3] = (unsigned char)((vals_a & 0xf) * 17);
 			
-			if (alpha)
-				a[3] = (unsigned char)0x00;
+			codes_rgb >>= 2;
+			vals_a >>= 4;
 		}
+	}
+}
+
+void decode_dxt5_block(unsigned char* from, unsigned char* to, unsigned int rowStride) {
+	unsigned char a0 = from[0];
+	unsigned char a1 = from[1];
+	unsigned long long codes_a = bufferReadLittleEndianLong(from, 2) & 0x0000ffffffffffffull;
+	
+	unsigned short c0 = bufferReadLittleEndianShort(from, 8);
+	unsigned short c1 = bufferReadLittleEndianShort(from, 10);
+	unsigned int codes_rgb = bufferReadLittleEndianInt(from, 12);
+	
+	unsigned char a[8];
+	
+	a[0] = a0;
+	a[1] = a1;
+	
+	if (a0 > a1) {
+		a[2] = (6 * a0 + 1 * a1) / 7;
+		a[3] = (5 * a0 + 2 * a1) / 7;
+		a[4] = (4 * a0 + 3 * a1) / 7;
+		a[5] = (3 * a0 + 4 * a1) / 7;
+		a[6] = (2 * a0 + 5 * a1) / 7;
+		a[7] = (1 * a0 + 6 * a1) / 7;
+	} else {
+		a[2] = (4 * a0 + 1 * a1) / 5;
+		a[3] = (3 * a0 + 2 * a1) / 5;
+		a[4] = (2 * a0 + 3 * a1) / 5;
+		a[5] = (1 * a0 + 4 * a1) / 5;
+		a[6] = (unsigned char)0x00;
+		a[7] = (unsigned char)0xff;
+	}
+	
+	unsigned char b[4];
+	unsigned char g[4];
+	unsigned char r[4];
+	
+	b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
+	g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
+	r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
+	
+	b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
+	g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
+	r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
+	
+	b[2] = (2 * b[0] + b[1]) / 3;
+	g[2] = (2 * g[0] + g[1]) / 3;
+	r[2] = (2 * r[0] + r[1]) / 3;
+	
+	b[3] = (b[0] + 2 * b[1]) / 3;
+	g[3] = (g[0] + 2 * g[1]) / 3;
+	r[3] = (r[0] + 2 * r[1]) / 3;
+	
+	unsigned int index, pixel_rgb, pixel_a;
+	
+	for (unsigned int row = 0; row < 4; row++) {
+		for (unsigned int col = 0; col < 4; col++) {
+			index = (row * rowStride) + (col << 2);
+			
+			pixel_rgb = codes_rgb & 0x3;
+			pixel_a = codes_a & 0x7;
+			
+			to[index] = b[pixel_rgb];
+			to[index + 1] = g[pixel_rgb];
+			to[index + 2] = r[pixel_rgb];
+			to[index + 3] = a[pixel_a];
+			
+			codes_rgb >>= 2;
+			codes_a >>= 3;
+		}
+	}
+}
+
+// Splits a 4x4 block of 32-bit pixels into the colour and alpha arrays the compressors take
+void gather_block(unsigned char* from, unsigned int rowStride, unsigned char* rgb, unsigned char* alpha) {
+	unsigned int fullIndex, rgbIndex;
+	
+	for (unsigned int row = 0; row < 4; row++) {
+		for (unsigned int col = 0; col < 4; col++) {
+			fullIndex = (row * rowStride) + (col << 2);
+			rgbIndex = ((row << 2) + col) * 3;
+			
+			rgb[rgbIndex] = from[fullIndex];
+			rgb[rgbIndex + 1] = from[fullIndex + 1];
+			rgb[rgbIndex + 2] = from[fullIndex + 2];
+			alpha[((row << 2) + col)] = from[fullIndex + 3];
+		}
+	}
+}
+
+// Reads 4 rows of 4 BGRA pixels, rowStride bytes apart, and writes one 16-byte DXT3 block
+void encode_dxt3_block(unsigned char* from, unsigned int rowStride, unsigned char* to) {
+	unsigned char uncompressedRGB[16 * 3];
+	unsigned char uncompressedAlpha[16];
+	
+	gather_block(from, rowStride, uncompressedRGB, uncompressedAlpha);
+	compress_dxt3(uncompressedRGB, uncompressedAlpha, to);
+}
+
+// DXT1 without alpha is the colour half alone.  With alpha, pixels under half opacity
+// take index 3 of the three-colour mode (c0 <= c1) and are left out of the endpoint fit.
+void encode_dxt1_block(unsigned char* from, unsigned int rowStride, unsigned char* to, bool alpha) {
+	unsigned char uncompressedRGB[16 * 3];
+	unsigned char uncompressedAlpha[16];
+	
+	gather_block(from, rowStride, uncompressedRGB, uncompressedAlpha);
+	
+	unsigned int opaque = 0;
+	unsigned int avg_b = 0, avg_g = 0, avg_r = 0;
+	for (int i = 0; i < 16; i++) {
+		if (!alpha || uncompressedAlpha[i] >= 128) {
+			opaque++;
+			avg_b += uncompressedRGB[3 * i];
+			avg_g += uncompressedRGB[3 * i + 1];
+			avg_r += uncompressedRGB[3 * i + 2];
+		}
+	}
+	
+	if (opaque == 16) {
+		compress_dxt_color(uncompressedRGB, to);
+		return;
+	}
+	if (opaque == 0) {
+		bufferWriteLittleEndianShort(to, 0, 0);
+		bufferWriteLittleEndianShort(to, 2, 0);
+		bufferWriteLittleEndianInt(to, 4, 0xffffffff);
+		return;
+	}
+	
+	// transparent pixels get the average of the others so they do not pull the endpoints
+	for (int i = 0; i < 16; i++) {
+		if (uncompressedAlpha[i] < 128) {
+			uncompressedRGB[3 * i] = (unsigned char)(avg_b / opaque);
+			uncompressedRGB[3 * i + 1] = (unsigned char)(avg_g / opaque);
+			uncompressedRGB[3 * i + 2] = (unsigned char)(avg_r / opaque);
+		}
+	}
+	compress_dxt_color(uncompressedRGB, to);
+	
+	// swapped into three-colour order
+	unsigned short c0 = bufferReadLittleEndianShort(to, 2);
+	unsigned short c1 = bufferReadLittleEndianShort(to, 0);
+	
+	int b[3], g[3], r[3];
+	b[0] = (c0 & 0x1f) * 255 / 31;
+	g[0] = ((c0 >> 5) & 0x3f) * 255 / 63;
+	r[0] = ((c0 >> 11) & 0x1f) * 255 / 31;
+	b[1] = (c1 & 0x1f) * 255 / 31;
+	g[1] = ((c1 >> 5) & 0x3f) * 255 / 63;
+	r[1] = ((c1 >> 11) & 0x1f) * 255 / 31;
+	b[2] = (b[0] + b[1]) / 2;
+	g[2] = (g[0] + g[1]) / 2;
+	r[2] = (r[0] + r[1]) / 2;
+	
+	unsigned int mapping = 0;
+	for (int i = 15; i >= 0; i--) {
+		unsigned int best = 3;
+		if (uncompressedAlpha[i] >= 128) {
+			int bestDistance = 0x7fffffff;
+			for (unsigned int j = 0; j < 3; j++) {
+				int db = uncompressedRGB[3 * i] - b[j];
+				int dg = uncompressedRGB[3 * i + 1] - g[j];
+				int dr = uncompressedRGB[3 * i + 2] - r[j];
+				int distance = db * db + dg * dg + dr * dr;
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					best = j;
+				}
+			}
+		}
+		mapping = (mapping << 2) | best;
+	}
+	
+	bufferWriteLittleEndianShort(to, 0, c0);
+	bufferWriteLittleEndianShort(to, 2, c1);
+	bufferWriteLittleEndianInt(to, 4, mapping);
+}
+
+// The interpolated alpha half of a DXT5 block, 16 values to 8 bytes: the block's extremes are
+// the endpoints (a0 > a1, so eight levels) and each pixel takes the nearest level
+void encode_dxt5_alpha(unsigned char* uncompressedAlpha, unsigned char* to) {
+	unsigned char a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		if (uncompressedAlpha[i] > a0)
+			a0 = uncompressedAlpha[i];
+		if (uncompressedAlpha[i] < a1)
+			a1 = uncompressedAlpha[i];
+	}
+	
+	unsigned long long codes_a = 0;
+	if (a0 > a1) {
+		int a[8];
+		a[0] = a0;
+		a[1] = a1;
+		for (int j = 2; j < 8; j++)
+			a[j] = ((8 - j) * a0 + (j - 1) * a1) / 7;
 		
-		unsigned int index, pixel_rgba;
-		
+		for (int i = 15; i >= 0; i--) {
+			unsigned int best = 0;
+			int bestDistance = 256;
+			for (unsigned int j = 0; j < 8; j++) {
+				int distance = abs(uncompressedAlpha[i] - a[j]);
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					best = j;
+				}
+			}
+			codes_a = (codes_a << 3) | best;
+		}
+	}
+	
+	to[0] = a0;
+	to[1] = a1;
+	for (int i = 0; i < 6; i++)
+		to[2 + i] = (unsigned char)((codes_a >> (i * 8)) & 0xff);
+}
+
+// Reads 4 rows of 4 BGRA pixels, rowStride bytes apart, and writes one 16-byte DXT5 block
+void encode_dxt5_block(unsigned char* from, unsigned int rowStride, unsigned char* to) {
+	unsigned char uncompressedRGB[16 * 3];
+	unsigned char uncompressedAlpha[16];
+	
+	gather_block(from, rowStride, uncompressedRGB, uncompressedAlpha);
+	encode_dxt5_alpha(uncompressedAlpha, to);
+	compress_dxt_color(uncompressedRGB, to + 8);
+}
+
+// DXT5nm: X (red) goes to the alpha block with its 8 interpolated levels and Y (green) to the
+// 6-bit green of the colour block; red is written full, blue empty, and Z is rebuilt by the shader.
+// Only green is searched, so the endpoints one step either side of its range can all be tried.
+void encode_dxt5nm_block(unsigned char* from, unsigned int rowStride, unsigned char* to) {
+	unsigned char x[16], y[16];
+	int low = 255, high = 0;
+	for (unsigned int row = 0; row < 4; row++) {
+		for (unsigned int col = 0; col < 4; col++) {
+			unsigned char* pixel = from + row * rowStride + (col << 2);
+			x[(row << 2) + col] = pixel[2];
+			y[(row << 2) + col] = pixel[1];
+			if (pixel[1] < low)
+				low = pixel[1];
+			if (pixel[1] > high)
+				high = pixel[1];
+		}
+	}
+	encode_dxt5_alpha(x, to);
+	
+	int g0 = (high * 63 + 127) / 255;
+	int g1 = (low * 63 + 127) / 255;
+	int bestError = -1;
+	unsigned int best0 = 1, best1 = 0, bestCodes = 0;
+	for (int e0 = g0 - 1; e0 <= g0 + 1; e0++) {
+		for (int e1 = g1 - 1; e1 <= g1 + 1; e1++) {
+			// c0 > c1 keeps the block in four-colour mode for every decoder
+			if (e1 < 0 || e0 > 63 || e0 <= e1)
+				continue;
+			int g[4];
+			g[0] = e0 * 255 / 63;
+			g[1] = e1 * 255 / 63;
+			g[2] = (2 * g[0] + g[1]) / 3;
+			g[3] = (g[0] + 2 * g[1]) / 3;
+			
+			int error = 0;
+			unsigned int codes = 0;
+			for (int i = 15; i >= 0; i--) {
+				unsigned int best = 0;
+				int bestDistance = 256;
+				for (unsigned int j = 0; j < 4; j++) {
+					int distance = abs(y[i] - g[j]);
+					if (distance < bestDistance) {
+						bestDistance = distance;
+						best = j;
+					}
+				}
+				error += bestDistance * bestDistance;
+				codes = (codes << 2) | best;
+			}
+			if (bestError < 0 || error < bestError) {
+				bestError = error;
+				best0 = e0;
+				best1 = e1;
+				bestCodes = codes;
+			}
+		}
+	}
+	
+	bufferWriteLittleEndianShort(to, 8, (unsigned short)((31 << 11) | (best0 << 5)));
+	bufferWriteLittleEndianShort(to, 10, (unsigned short)((31 << 11) | (best1 << 5)));
+	bufferWriteLittleEndianInt(to, 12, bestCodes);
+}
+
+// Colour table entry of pixel (x, y) of an indexed bitmap; the leftmost pixel is in the highest bits
+inline unsigned char* ConversionJob::indexedColor(unsigned char* from, unsigned int x, unsigned int y) {
+	unsigned char* row = from + y * indexStride;
+	unsigned int index;
+	if (indexBits == 8)
+		index = row[x];
+	else if (indexBits == 4)
+		index = (row[x >> 1] >> ((~x & 1) << 2)) & 0xf;
+	else
+		index = (row[x >> 3] >> (~x & 7)) & 0x1;
+	return colorTable[index];
+}
+
+// Fused converters: a Source loads one 4x4 block of BGRA pixels (64 bytes, row-major) straight
+// from the input format and a Dest stores it straight into the output format, so a pair
+// makes one pass over memory without a 32-bit copy of the image in between.
+// i is the block index, (x_coord, y_coord) its top-left pixel.
+
+struct Src_24 {
+	static const char* name() { return "24"; }
+	static void loadBlock(ConversionJob* job, unsigned char* from, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord, unsigned char* block) {
 		for (unsigned int row = 0; row < 4; row++) {
+			unsigned char* src = from + (((y_coord + row) * job->width) + x_coord) * 3;
 			for (unsigned int col = 0; col < 4; col++) {
-				index = (((y_coord + row) * width) + x_coord + col) << 2;
-				
-				pixel_rgba = codes_rgba & 0x3;
-				
-				to[index] = b[pixel_rgba];
-				to[index + 1] = g[pixel_rgba];
-				to[index + 2] = r[pixel_rgba];
-				to[index + 3] = a[pixel_rgba];
-				
-				codes_rgba >>= 2;
+				block[(row << 4) + (col << 2)] = src[col * 3];
+				block[(row << 4) + (col << 2) + 1] = src[col * 3 + 1];
+				block[(row << 4) + (col << 2) + 2] = src[col * 3 + 2];
+				block[(row << 4) + (col << 2) + 3] = (unsigned char)0xff;
 			}
 		}
 	}
-	return true;
-}
+};
 
-bool conv_dxt3_to_32(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)((width * height) >> 4); i++) {
-		unsigned long long vals_a = bufferReadLittleEndianLong(from, i * 16);
-		unsigned short c0 = bufferReadLittleEndianShort(from, i * 16 + 8);
-		unsigned short c1 = bufferReadLittleEndianShort(from, i * 16 + 10);
-		unsigned int codes_rgb = bufferReadLittleEndianInt(from, i * 16 + 12);
-		
-		unsigned int x_coord = (i % (width >> 2)) << 2;
-		unsigned int y_coord = ((i << 2) / width) << 2;
-		
-		unsigned char b[4];
-		unsigned char g[4];
-		unsigned char r[4];
-		
-		b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
-		g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
-		r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
-		
-		b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
-		g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
-		r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
-		
-		b[2] = (2 * b[0] + b[1]) / 3;
-		g[2] = (2 * g[0] + g[1]) / 3;
-		r[2] = (2 * r[0] + r[1]) / 3;
-		
-		b[3] = (b[0] + 2 * b[1]) / 3;
-		g[3] = (g[0] + 2 * g[1]) / 3;
-		r[3] = (r[0] + 2 * r[1]) / 3;
-		
-		unsigned int index, pixel_rgb;
-		
+struct Src_32 {
+	static const char* name() { return "32"; }
+	static void loadBlock(ConversionJob* job, unsigned char* from, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord, unsigned char* block) {
+		for (unsigned int row = 0; row < 4; row++) {
+			memcpy(block + (row << 4), from + ((((y_coord + row) * job->width) + x_coord) << 2), 16);
+		}
+	}
+};
+
+// A shrunk image bound for a block format, with every block in one 64-byte run
+struct Src_tiled32 {
+	static const char* name() { return "tiled32"; }
+	static void loadBlock(ConversionJob* /*job*/, unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* block) {
+		memcpy(block, from + (i << 6), 64);
+	}
+};
+
+struct Src_16 {
+	static const char* name() { return "16"; }
+	static void loadBlock(ConversionJob* job, unsigned char* from, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord, unsigned char* block) {
 		for (unsigned int row = 0; row < 4; row++) {
+			unsigned char* src = from + ((((y_coord + row) * job->width) + x_coord) << 1);
 			for (unsigned int col = 0; col < 4; col++) {
-				index = (((y_coord + row) * width) + x_coord + col) << 2;
-				
-				pixel_rgb = codes_rgb & 0x3;
-				
-				to[index] = b[pixel_rgb];
-				to[index + 1] = g[pixel_rgb];
-				to[index + 2] = r[pixel_rgb];
-				to[index + 3] = (unsigned char)((vals_a & 0xf) * 17);
-				
-				codes_rgb >>= 2;
-				vals_a >>= 4;
+				decode_16_pixel(src[col * 2] + (src[col * 2 + 1] << 8), block + (row << 4) + (col << 2));
 			}
 		}
 	}
-	return true;
-}
+};
 
-bool conv_dxt5_to_32(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)((width * height) >> 4); i++) {
-		unsigned char a0 = from[i * 16];
-		unsigned char a1 = from[i * 16 + 1];
-		unsigned long long codes_a = bufferReadLittleEndianLong(from, i * 16 + 2) & 0x0000ffffffffffffull;
-		
-		unsigned short c0 = bufferReadLittleEndianShort(from, i * 16 + 8);
-		unsigned short c1 = bufferReadLittleEndianShort(from, i * 16 + 10);
-		unsigned int codes_rgb = bufferReadLittleEndianInt(from, i * 16 + 12);
-		
-		unsigned int x_coord = (i % (width >> 2)) << 2;
-		unsigned int y_coord = ((i << 2) / width) << 2;
-		
-		unsigned char a[8];
-		
-		a[0] = a0;
-		a[1] = a1;
-		
-		if (a0 > a1) {
-			a[2] = (6 * a0 + 1 * a1) / 7;
-			a[3] = (5 * a0 + 2 * a1) / 7;
-			a[4] = (4 * a0 + 3 * a1) / 7;
-			a[5] = (3 * a0 + 4 * a1) / 7;
-			a[6] = (2 * a0 + 5 * a1) / 7;
-			a[7] = (1 * a0 + 6 * a1) / 7;
-		} else {
-			a[2] = (4 * a0 + 1 * a1) / 5;
-			a[3] = (3 * a0 + 2 * a1) / 5;
-			a[4] = (2 * a0 + 3 * a1) / 5;
-			a[5] = (1 * a0 + 4 * a1) / 5;
-			a[6] = (unsigned char)0x00;
-			a[7] = (unsigned char)0xff;
+struct Src_mask16 {
+	static const char* name() { return "mask16"; }
+	static void loadBlock(ConversionJob* job, unsigned char* from, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord, unsigned char* block) {
+		for (unsigned int row = 0; row < 4; row++) {
+			unsigned char* src = from + ((((y_coord + row) * job->width) + x_coord) << 1);
+			for (unsigned int col = 0; col < 4; col++) {
+				job->decode_mask16_pixel(src[col * 2] + (src[col * 2 + 1] << 8), block + (row << 4) + (col << 2));
+			}
 		}
-		
-		unsigned char b[4];
-		unsigned char g[4];
-		unsigned char r[4];
-		
-		b[0] = (unsigned char)((c0 & 0x1f) * 255 / 31);
-		g[0] = (unsigned char)(((c0 >> 5) & 0x3f) * 255 / 63);
-		r[0] = (unsigned char)(((c0 >> 11) & 0x1f) * 255 / 31);
-		
-		b[1] = (unsigned char)((c1 & 0x1f) * 255 / 31);
-		g[1] = (unsigned char)(((c1 >> 5) & 0x3f) * 255 / 63);
-		r[1] = (unsigned char)(((c1 >> 11) & 0x1f) * 255 / 31);
-		
-		b[2] = (2 * b[0] + b[1]) / 3;
-		g[2] = (2 * g[0] + g[1]) / 3;
-		r[2] = (2 * r[0] + r[1]) / 3;
-		
-		b[3] = (b[0] + 2 * b[1]) / 3;
-		g[3] = (g[0] + 2 * g[1]) / 3;
-		r[3] = (r[0] + 2 * r[1]) / 3;
-		
-		unsigned int index, pixel_rgb, pixel_a;
-		
+	}
+};
+
+// The index depth is the same for the whole image, so the branch in indexedColor is predictable
+// and the table lookups of a row are independent loads the wider variants can gather
+struct Src_indexed {
+	static const char* name() { return "indexed"; }
+	static void loadBlock(ConversionJob* job, unsigned char* from, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord, unsigned char* block) {
+		for (unsigned int row = 0; row < 4; row++) {
+			for (unsigned int col = 0; col < 4; col++)
+				memcpy(block + (row << 4) + (col << 2), job->indexedColor(from, x_coord + col, y_coord + row), 4);
+		}
+	}
+};
+
+template <bool alpha>
+struct Src_dxt1 {
+	static const char* name() { return alpha ? "dxt1a" : "dxt1"; }
+	static void loadBlock(ConversionJob* /*job*/, unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* block) {
+		decode_dxt1_block(from + i * 8, block, 16, alpha);
+	}
+};
+
+struct Src_dxt3 {
+	static const char* name() { return "dxt3"; }
+	static void loadBlock(ConversionJob* /*job*/, unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* block) {
+		decode_dxt3_block(from + i * 16, block, 16);
+	}
+};
+
+struct Src_dxt5 {
+	static const char* name() { return "dxt5"; }
+	static void loadBlock(ConversionJob* /*job*/, unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* block) {
+		decode_dxt5_block(from + i * 16, block, 16);
+	}
+};
+
+struct Dst_24 {
+	static const char* name() { return "24"; }
+	static void storeBlock(ConversionJob* job, unsigned char* block, unsigned char* to, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord) {
 		for (unsigned int row = 0; row < 4; row++) {
+			unsigned char* dst = to + (((y_coord + row) * job->width) + x_coord) * 3;
 			for (unsigned int col = 0; col < 4; col++) {
-				index = (((y_coord + row) * width) + x_coord + col) << 2;
-				
-				pixel_rgb = codes_rgb & 0x3;
-				pixel_a = codes_a & 0x7;
-				
-				to[index] = b[pixel_rgb];
-				to[index + 1] = g[pixel_rgb];
-				to[index + 2] = r[pixel_rgb];
-				to[index + 3] = a[pixel_a];
-				
-				codes_rgb >>= 2;
-				codes_a >>= 3;
+				dst[col * 3] = block[(row << 4) + (col << 2)];
+				dst[col * 3 + 1] = block[(row << 4) + (col << 2) + 1];
+				dst[col * 3 + 2] = block[(row << 4) + (col << 2) + 2];
 			}
 		}
 	}
-	return true;
-}
+};
 
-bool conv_32_to_dxt3(unsigned char* from, unsigned char* to) {
-#pragma omp parallel for
-	for (int i = 0; i < (int)((width * height) >> 4); i++) {
-		unsigned int x_coord = (i % (width >> 2)) << 2;
-		unsigned int y_coord = ((i << 2) / width) << 2;
-		
-		unsigned char* uncompressedRGB = (unsigned char*)malloc(16 * 3 * sizeof(unsigned char));
-		unsigned char* uncompressedAlpha = (unsigned char*)malloc(16 * sizeof(unsigned char));
-		
-		unsigned int fullIndex, rgbIndex;
-		
+struct Dst_32 {
+	static const char* name() { return "32"; }
+	static void storeBlock(ConversionJob* job, unsigned char* block, unsigned char* to, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord) {
+		for (unsigned int row = 0; row < 4; row++) {
+			memcpy(to + ((((y_coord + row) * job->width) + x_coord) << 2), block + (row << 4), 16);
+		}
+	}
+};
+
+struct Dst_dxt3 {
+	static const char* name() { return "dxt3"; }
+	static void storeBlock(ConversionJob* /*job*/, unsigned char* block, unsigned char* to, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/) {
+		encode_dxt3_block(block, 16, to + (i << 4));
+	}
+};
+
+template <bool alpha>
+struct Dst_dxt1 {
+	static const char* name() { return alpha ? "dxt1a" : "dxt1"; }
+	static void storeBlock(ConversionJob* /*job*/, unsigned char* block, unsigned char* to, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/) {
+		encode_dxt1_block(block, 16, to + (i << 3), alpha);
+	}
+};
+
+// Packs to the job's 16-bit layout; the ordered dither, when on, uses the pixel's place in the block
+struct Dst_mask16 {
+	static const char* name() { return "mask16"; }
+	static void storeBlock(ConversionJob* job, unsigned char* block, unsigned char* to, unsigned int /*i*/, unsigned int x_coord, unsigned int y_coord) {
+		const unsigned int* bits = layoutBits[job->outputLayout];
 		for (unsigned int row = 0; row < 4; row++) {
 			for (unsigned int col = 0; col < 4; col++) {
-				fullIndex = (((y_coord + row) * width) + x_coord + col) << 2;
-				rgbIndex = ((row << 2) + col) * 3;
-				
-				uncompressedRGB[rgbIndex] = from[fullIndex];
-				uncompressedRGB[rgbIndex + 1] = from[fullIndex + 1];
-				uncompressedRGB[rgbIndex + 2] = from[fullIndex + 2];
-				uncompressedAlpha[((row << 2) + col)] = from[fullIndex + 3];
+				unsigned int k = (row << 2) + col;
+				unsigned int value = 0, shift = 0;
+				for (unsigned int c = 0; c < 4; c++) {
+					unsigned int levels = (1 << bits[c]) - 1;
+					// rounds to nearest, or to a neighbour by the dither threshold; alpha is never dithered
+					unsigned int threshold = (job->outputDither && c < 3) ? (2 * bayer4x4[k] + 1) * 255 : 16 * 255;
+					value |= ((block[(k << 2) + c] * levels * 32 + threshold) / (255 * 32)) << shift;
+					shift += bits[c];
+				}
+				bufferWriteLittleEndianShort(to, (((y_coord + row) * job->width) + x_coord + col) << 1, (unsigned short)value);
+			}
+		}
+	}
+};
+
+struct Dst_dxt5 {
+	static const char* name() { return "dxt5"; }
+	static void storeBlock(ConversionJob* /*job*/, unsigned char* block, unsigned char* to, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/) {
+		encode_dxt5_block(block, 16, to + (i << 4));
+	}
+};
+
+struct Dst_dxt5nm {
+	static const char* name() { return "dxt5nm"; }
+	static void storeBlock(ConversionJob* /*job*/, unsigned char* block, unsigned char* to, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/) {
+		encode_dxt5nm_block(block, 16, to + (i << 4));
+	}
+};
+
+// What --auto needs to know about one 4x4 block
+struct BlockStats {
+	unsigned char minAlpha;
+	unsigned char maxAlpha;
+	unsigned char alphaErrorDXT3; // worst pixel error of 4-bit alpha
+	unsigned char colorError; // how far the colours stray from a single line, which is all DXT can store
+	bool binaryAlpha; // every pixel within 16 of fully transparent or fully opaque
+};
+
+// Not an image format: fills an array of BlockStats, one per block
+struct Dst_stats {
+	static const char* name() { return "stats"; }
+	static void storeBlock(ConversionJob* /*job*/, unsigned char* block, unsigned char* to, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/) {
+		BlockStats* stats = (BlockStats*)to + i;
+		unsigned char minAlpha = 255, maxAlpha = 0, errorDXT3 = 0;
+		bool binary = true;
+		int low[3] = { 255, 255, 255 }, high[3] = { 0, 0, 0 };
+		for (int j = 0; j < 16; j++) {
+			unsigned char a = block[(j << 2) + 3];
+			minAlpha = a < minAlpha ? a : minAlpha;
+			maxAlpha = a > maxAlpha ? a : maxAlpha;
+			unsigned char error = (unsigned char)abs(a - ((a + 8) / 17) * 17);
+			errorDXT3 = error > errorDXT3 ? error : errorDXT3;
+			binary = binary && (a < 16 || a > 239);
+			for (int c = 0; c < 3; c++) {
+				low[c] = block[(j << 2) + c] < low[c] ? block[(j << 2) + c] : low[c];
+				high[c] = block[(j << 2) + c] > high[c] ? block[(j << 2) + c] : high[c];
 			}
 		}
 		
-		unsigned char* compressedBlock = compress_dxt3(uncompressedRGB, uncompressedAlpha);
-		
-		for (unsigned int j = 0; j < 16; j++) {
-			to[(i << 4) + j] = compressedBlock[j];
+		// distance of each pixel from the diagonal of the block's colour bounding box
+		int axis[3] = { high[0] - low[0], high[1] - low[1], high[2] - low[2] };
+		int axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+		double worst = 0;
+		if (axisLength > 0) {
+			for (int j = 0; j < 16; j++) {
+				int v[3];
+				for (int c = 0; c < 3; c++)
+					v[c] = block[(j << 2) + c] - low[c];
+				double t = (double)(v[0] * axis[0] + v[1] * axis[1] + v[2] * axis[2]) / axisLength;
+				double distance = 0;
+				for (int c = 0; c < 3; c++)
+					distance += (v[c] - t * axis[c]) * (v[c] - t * axis[c]);
+				worst = distance > worst ? distance : worst;
+			}
 		}
 		
-		free(uncompressedRGB);
-		free(uncompressedAlpha);
-		free(compressedBlock);
+		stats->minAlpha = minAlpha;
+		stats->maxAlpha = maxAlpha;
+		stats->alphaErrorDXT3 = errorDXT3;
+		stats->colorError = (unsigned char)(worst < 255 * 255 ? sqrt(worst) : 255);
+		stats->binaryAlpha = binary;
+	}
+};
+
+// Converts blocks first to last - 1; every instruction set variant is built from this
+template <class Source, class Dest>
+inline void fusedBlocks(ConversionJob* job, unsigned char* from, unsigned char* to, unsigned int first, unsigned int last) {
+	unsigned char block[64];
+	for (unsigned int i = first; i < last; i++) {
+		unsigned int x_coord = (i % (job->width >> 2)) << 2;
+		unsigned int y_coord = ((i << 2) / job->width) << 2;
+		
+		Source::loadBlock(job, from, i, x_coord, y_coord, block);
+		Dest::storeBlock(job, block, to, i, x_coord, y_coord);
 	}
-	return true;
 }
 
-bool initialConvertTo32() {
-	convertBufferSize = width * height * 4;
-	convertFileBuffer = (unsigned char*)malloc(convertBufferSize * sizeof(unsigned char));
-	switch (inputFileType) {
-	case STD_24:
-		return conv_24_to_32(inputFileBuffer, convertFileBuffer);
-	case STD_32:
-	case FS_32:
-		free(convertFileBuffer);
-		convertFileBuffer = inputFileBuffer;
-		inputFileBuffer = NULL;
-		return true;
-	case FS_DXT1:
-		return conv_dxt1_to_32(inputFileBuffer, convertFileBuffer, false);
-	case FS_DXT1A:
-		return conv_dxt1_to_32(inputFileBuffer, convertFileBuffer, true);
-	case FS_DXT3:
-		return conv_dxt3_to_32(inputFileBuffer, convertFileBuffer);
+#ifdef CPU_DISPATCH
+// A copy of fusedBlocks with the loaders, decoders and encoders it calls inlined and compiled for one instruction set
+#define FUSED_VARIANT(suffix, isa) \
+template <class Source, class Dest> __attribute__((target(isa), flatten)) \
+void fusedBlocks_##suffix(ConversionJob* job, unsigned char* from, unsigned char* to, unsigned int first, unsigned int last) { \
+	fusedBlocks<Source, Dest>(job, from, to, first, last); \
+}
+FUSED_VARIANT(sse41, "sse4.1")
+FUSED_VARIANT(avx2, "avx2")
+FUSED_VARIANT(avx512, "avx512f")
+#endif
+
+template <class Source, class Dest>
+bool ConversionJob::conv_fused(unsigned char* from, unsigned char* to) {
+	unsigned int blocks = (width * height) >> 4;
+	unsigned int grain = blockGrain();
+	char kernel[64];
+	if (profiling)
+		snprintf(kernel, sizeof(kernel), "conv_fused<%s, %s>", Source::name(), Dest::name());
+	KernelProfile profile(kernel, (unsigned long long)width * height);
+	
+PARALLEL_CHUNKS(1)
+	for (int first = 0; first < (int)blocks; first += grain) {
+		unsigned int last = first + grain < blocks ? first + grain : blocks;
+#ifdef CPU_DISPATCH
+		switch (cpuLevel) {
+		case CPU_AVX512:
+			fusedBlocks_avx512<Source, Dest>(this, from, to, first, last);
+			break;
+		case CPU_AVX2:
+			fusedBlocks_avx2<Source, Dest>(this, from, to, first, last);
+			break;
+		case CPU_SSE41:
+			fusedBlocks_sse41<Source, Dest>(this, from, to, first, last);
+			break;
+		default:
+			fusedBlocks<Source, Dest>(this, from, to, first, last);
+			break;
+		}
+#else
+		fusedBlocks<Source, Dest>(this, from, to, first, last);
+#endif
+	}
+	return true;
+}
+
+template <class Dest>
+bool ConversionJob::conv_fused_from_input(unsigned char* from, unsigned char* to) {
+	switch (inputFileType) {
+	case STD_24:
+		return conv_fused<Src_24, Dest>(from, to);
+	case STD_32:
+	case FS_32:
+		if (tiledInput)
+			return conv_fused<Src_tiled32, Dest>(from, to);
+		return conv_fused<Src_32, Dest>(from, to);
+	case FS_DXT1:
+		return conv_fused<Src_dxt1<false>, Dest>(from, to);
+	case FS_DXT1A:
+		return conv_fused<Src_dxt1<true>, Dest>(from, to);
+	case FS_DXT3:
+		return conv_fused<Src_dxt3, Dest>(from, to);
+	case FS_DXT5:
+		return conv_fused<Src_dxt5, Dest>(from, to);
+	case STD_16:
+		return conv_fused<Src_16, Dest>(from, to);
+	case MASK_16:
+		return conv_fused<Src_mask16, Dest>(from, to);
+	case STD_INDEXED:
+		return conv_fused<Src_indexed, Dest>(from, to);
+	default:
+		return false;
+	}
+}
+
+void ConversionJob::makeOutputHeader_FS_dxt(int fileType) {
+	outputHeaderSize = 74;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'B';
+	outputHeaderBuffer[1] = 'M';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
+	outputHeaderBuffer[10] = (unsigned char)0x4a; // index where image starts 74
+	outputHeaderBuffer[14] = (unsigned char)0x28;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
+	outputHeaderBuffer[26] = (unsigned char)0x1;
+	outputHeaderBuffer[28] = (unsigned char)0x10; // bitdepth 16
+	outputHeaderBuffer[30] = 'D';
+	outputHeaderBuffer[31] = 'X';
+	outputHeaderBuffer[32] = 'T';
+	outputHeaderBuffer[33] = fileType == FS_DXT5 ? '5' : fileType == FS_DXT3 ? '3' : '1';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, levelSize(fileType, width, height));
+	
+	// Flight Simulator Compatible header
+	outputHeaderBuffer[54] = 'F';
+	outputHeaderBuffer[55] = 'S';
+	outputHeaderBuffer[56] = '7';
+	outputHeaderBuffer[57] = '0';
+	outputHeaderBuffer[58] = (unsigned char)0x14;
+	// This is 4 for 32-bit, DXT3, DXT5; 1 for DXT1; 2 for DXT1A
+	outputHeaderBuffer[63] = (unsigned char)(fileType == FS_DXT1 ? 0x1 : fileType == FS_DXT1A ? 0x2 : 0x4);
+	if (outputMipLevels > 1)
+		bufferWriteLittleEndianShort(outputHeaderBuffer, 68, (unsigned short)outputMipLevels);
+}
+
+void ConversionJob::makeOutputHeader_FS_32() {
+	outputHeaderSize = 74;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'B';
+	outputHeaderBuffer[1] = 'M';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
+	outputHeaderBuffer[10] = (unsigned char)0x4a; // index where image starts 74
+	outputHeaderBuffer[14] = (unsigned char)0x28;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
+	outputHeaderBuffer[26] = (unsigned char)0x1;
+	outputHeaderBuffer[28] = (unsigned char)0x20; // bitdepth 32
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, levelSize(FS_32, width, height));
+	
+	// Flight Simulator Compatible header
+	outputHeaderBuffer[54] = 'F';
+	outputHeaderBuffer[55] = 'S';
+	outputHeaderBuffer[56] = '7';
+	outputHeaderBuffer[57] = '0';
+	outputHeaderBuffer[58] = (unsigned char)0x14;
+	outputHeaderBuffer[63] = (unsigned char)0x4; // This is 4 for 32-bit, DXT3, DXT5; 1 for DXT1; 2 for DXT1A
+	if (outputMipLevels > 1)
+		bufferWriteLittleEndianShort(outputHeaderBuffer, 68, (unsigned short)outputMipLevels);
+}
+
+void ConversionJob::makeOutputHeader_STD_24() {
+	outputHeaderSize = 54;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'B';
+	outputHeaderBuffer[1] = 'M';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
+	outputHeaderBuffer[10] = (unsigned char)0x36; // index where image starts 54
+	outputHeaderBuffer[14] = (unsigned char)0x28;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
+	outputHeaderBuffer[26] = (unsigned char)0x1;
+	outputHeaderBuffer[28] = (unsigned char)0x18; // bitdepth 24
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
+}
+
+void ConversionJob::makeOutputHeader_STD_32() {
+	outputHeaderSize = 54;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'B';
+	outputHeaderBuffer[1] = 'M';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
+	outputHeaderBuffer[10] = (unsigned char)0x36; // index where image starts 54
+	outputHeaderBuffer[14] = (unsigned char)0x28;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
+	outputHeaderBuffer[26] = (unsigned char)0x1;
+	outputHeaderBuffer[28] = (unsigned char)0x20; // bitdepth 32
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
+}
+
+// BITMAPV3INFOHEADER with the bit masks of outputLayout
+void ConversionJob::makeOutputHeader_MASK_16() {
+	outputHeaderSize = 70;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'B';
+	outputHeaderBuffer[1] = 'M';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
+	outputHeaderBuffer[10] = (unsigned char)0x46; // index where image starts 70
+	outputHeaderBuffer[14] = (unsigned char)0x38;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
+	outputHeaderBuffer[26] = (unsigned char)0x1;
+	outputHeaderBuffer[28] = (unsigned char)0x10; // bitdepth 16
+	outputHeaderBuffer[30] = (unsigned char)0x3; // bit fields
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
+	
+	// red, green, blue and alpha masks
+	unsigned int masks[4], shift = 0;
+	for (int c = 0; c < 4; c++) {
+		masks[c] = ((1 << layoutBits[outputLayout][c]) - 1) << shift;
+		shift += layoutBits[outputLayout][c];
+	}
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 54, masks[2]);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 58, masks[1]);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 62, masks[0]);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 66, masks[3]);
+}
+
+void ConversionJob::makeOutputHeader_DDS() {
+	outputHeaderSize = 128;
+	outputFileSize = outputHeaderSize + outputBufferSize;
+	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
+	outputHeaderBuffer[0] = 'D';
+	outputHeaderBuffer[1] = 'D';
+	outputHeaderBuffer[2] = 'S';
+	outputHeaderBuffer[3] = ' ';
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 4, 124);
+	
+	// CAPS | HEIGHT | WIDTH | PIXELFORMAT, then LINEARSIZE or PITCH, and MIPMAPCOUNT
+	unsigned int flags = 0x1 | 0x2 | 0x4 | 0x1000;
+	flags |= isBlockCompressed(outputFileType) ? 0x80000 : 0x8;
+	if (outputMipLevels > 1)
+		flags |= 0x20000;
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 8, flags);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 12, height);
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 16, width);
+	if (isBlockCompressed(outputFileType))
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 20, levelSize(outputFileType, width, height));
+	else
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 20, levelSize(outputFileType, width, 1));
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 28, outputMipLevels);
+	
+	// Pixel format
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 76, 32);
+	switch (outputFileType) {
+	case FS_DXT1:
+	case FS_DXT1A:
+	case FS_DXT3:
+	case FS_DXT5:
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 80, 0x4); // DDPF_FOURCC
+		outputHeaderBuffer[84] = 'D';
+		outputHeaderBuffer[85] = 'X';
+		outputHeaderBuffer[86] = 'T';
+		outputHeaderBuffer[87] = outputFileType == FS_DXT5 ? '5' : outputFileType == FS_DXT3 ? '3' : '1';
+		break;
+	case STD_32:
+	case FS_32:
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 80, 0x40 | 0x1); // DDPF_RGB | DDPF_ALPHAPIXELS
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 88, 32);
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 104, 0xff000000);
+		break;
+	case STD_24:
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 80, 0x40); // DDPF_RGB
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 88, 24);
+		break;
+	}
+	if (!isBlockCompressed(outputFileType)) {
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 92, 0x00ff0000);
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 96, 0x0000ff00);
+		bufferWriteLittleEndianInt(outputHeaderBuffer, 100, 0x000000ff);
+	}
+	
+	// TEXTURE, plus COMPLEX | MIPMAP with mips
+	bufferWriteLittleEndianInt(outputHeaderBuffer, 108, outputMipLevels > 1 ? 0x1000 | 0x8 | 0x400000 : 0x1000);
+}
+
+// Previews: every 4x4 block becomes one pixel holding its average colour
+
+unsigned int countBits(unsigned int value) {
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+// Average of a DXT colour block computed from its endpoints and how often each index is used,
+// which gives the same result as decoding all 16 pixels and averaging them
+void average_dxt_color_block(unsigned char* from, bool dxt1, unsigned char* to) {
+	unsigned short c0 = bufferReadLittleEndianShort(from, 0);
+	unsigned short c1 = bufferReadLittleEndianShort(from, 2);
+	unsigned int codes = bufferReadLittleEndianInt(from, 4);
+	
+	unsigned int low = codes & 0x55555555;
+	unsigned int high = (codes >> 1) & 0x55555555;
+	unsigned int n3 = countBits(low & high);
+	unsigned int n1 = countBits(low) - n3;
+	unsigned int n2 = countBits(high) - n3;
+	unsigned int n0 = 16 - n1 - n2 - n3;
+	
+	bool fourColor = !dxt1 || c0 > c1;
+	
+	unsigned int e0[3], e1[3];
+	e0[0] = (c0 & 0x1f) * 255 / 31;
+	e0[1] = ((c0 >> 5) & 0x3f) * 255 / 63;
+	e0[2] = ((c0 >> 11) & 0x1f) * 255 / 31;
+	e1[0] = (c1 & 0x1f) * 255 / 31;
+	e1[1] = ((c1 >> 5) & 0x3f) * 255 / 63;
+	e1[2] = ((c1 >> 11) & 0x1f) * 255 / 31;
+	
+	for (int c = 0; c < 3; c++) {
+		unsigned int e2 = fourColor ? (2 * e0[c] + e1[c]) / 3 : (e0[c] + e1[c]) / 2;
+		unsigned int e3 = fourColor ? (e0[c] + 2 * e1[c]) / 3 : 0;
+		to[c] = (unsigned char)((n0 * e0[c] + n1 * e1[c] + n2 * e2 + n3 * e3 + 8) >> 4);
+	}
+	to[3] = (unsigned char)0xff;
+}
+
+template <class Source>
+void ConversionJob::averageBlock(unsigned char* from, unsigned int i, unsigned int x_coord, unsigned int y_coord, unsigned char* to) {
+	unsigned char block[64];
+	Source::loadBlock(this, from, i, x_coord, y_coord, block);
+	for (int c = 0; c < 3; c++) {
+		unsigned int sum = 0;
+		for (int j = 0; j < 16; j++)
+			sum += block[(j << 2) + c];
+		to[c] = (unsigned char)((sum + 8) >> 4);
+	}
+	to[3] = (unsigned char)0xff;
+}
+
+template <>
+void ConversionJob::averageBlock<Src_dxt1<false> >(unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* to) {
+	average_dxt_color_block(from + i * 8, true, to);
+}
+
+template <>
+void ConversionJob::averageBlock<Src_dxt1<true> >(unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* to) {
+	average_dxt_color_block(from + i * 8, true, to);
+}
+
+template <>
+void ConversionJob::averageBlock<Src_dxt3>(unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* to) {
+	average_dxt_color_block(from + i * 16 + 8, false, to);
+}
+
+template <>
+void ConversionJob::averageBlock<Src_dxt5>(unsigned char* from, unsigned int i, unsigned int /*x_coord*/, unsigned int /*y_coord*/, unsigned char* to) {
+	average_dxt_color_block(from + i * 16 + 8, false, to);
+}
+
+// Writes a (width / 4) x (height / 4) 32-bit image
+template <class Source>
+bool ConversionJob::conv_preview(unsigned char* from, unsigned char* to) {
+	char kernel[64];
+	if (profiling)
+		snprintf(kernel, sizeof(kernel), "conv_preview<%s>", Source::name());
+	KernelProfile profile(kernel, (unsigned long long)width * height);
+PARALLEL_CHUNKS(blockGrain())
+	for (int i = 0; i < (int)((width * height) >> 4); i++) {
+		unsigned int x_coord = (i % (width >> 2)) << 2;
+		unsigned int y_coord = ((i << 2) / width) << 2;
+		averageBlock<Source>(from, i, x_coord, y_coord, to + (i << 2));
+	}
+	return true;
+}
+
+bool ConversionJob::conv_preview_from_input(unsigned char* from, unsigned char* to) {
+	switch (inputFileType) {
+	case STD_24:
+		return conv_preview<Src_24>(from, to);
+	case STD_32:
+	case FS_32:
+		return conv_preview<Src_32>(from, to);
+	case FS_DXT1:
+		return conv_preview<Src_dxt1<false> >(from, to);
+	case FS_DXT1A:
+		return conv_preview<Src_dxt1<true> >(from, to);
+	case FS_DXT3:
+		return conv_preview<Src_dxt3>(from, to);
 	case FS_DXT5:
-		return conv_dxt5_to_32(inputFileBuffer, convertFileBuffer);
+		return conv_preview<Src_dxt5>(from, to);
 	case STD_16:
-		return conv_16_to_32(inputFileBuffer, convertFileBuffer);
+		return conv_preview<Src_16>(from, to);
+	case MASK_16:
+		return conv_preview<Src_mask16>(from, to);
+	case STD_INDEXED:
+		return conv_preview<Src_indexed>(from, to);
+	default:
+		return false;
+	}
+}
+
+// Averaging shortens normals, so after each halving of a normal map (X, Y and Z stored unsigned
+// in red, green and blue) every pixel is scaled back to unit length
+void renormalize_32(unsigned char* image, unsigned int pixels) {
+	for (unsigned int i = 0; i < pixels; i++) {
+		unsigned char* pixel = image + (i << 2);
+		float v[3];
+		for (int c = 0; c < 3; c++)
+			v[c] = pixel[c] / 127.5f - 1.0f;
+		float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+		if (length < 1e-6f) {
+			// opposite normals cancelled out; point straight out of the surface
+			v[0] = 1.0f;
+			v[1] = 0.0f;
+			v[2] = 0.0f;
+			length = 1.0f;
+		}
+		for (int c = 0; c < 3; c++) {
+			float value = (v[c] / length + 1.0f) * 127.5f + 0.5f;
+			pixel[c] = (unsigned char)(value < 0.0f ? 0.0f : value > 255.0f ? 255.0f : value);
+		}
+	}
+}
+
+// Halves a row-major 32-bit image in both directions with a 2x2 box filter.  The result is
+// row-major, or with tiled a 4x4 block per 64 bytes (blocks in row-major order), which needs
+// at least 4x4 pixels.  The inner loops run over plain bytes so the compiler can vectorise them.
+bool box_downscale_32(unsigned char* from, unsigned char* to, unsigned int fromWidth, unsigned int fromHeight, bool tiled) {
+	unsigned int toWidth = fromWidth >> 1;
+	unsigned int toHeight = fromHeight >> 1;
+	unsigned int grain = CHUNK_BYTES / (fromWidth << 3) + 1;
+PARALLEL_CHUNKS(grain)
+	for (int y = 0; y < (int)toHeight; y++) {
+		unsigned char* top = from + ((y * 2) * fromWidth << 2);
+		unsigned char* bottom = top + (fromWidth << 2);
+		if (!tiled) {
+			unsigned char* dst = to + (y * toWidth << 2);
+			for (unsigned int k = 0; k < (toWidth << 2); k++) {
+				unsigned int src = (k << 1) - (k & 0x3);
+				dst[k] = (unsigned char)((top[src] + top[src + 4] + bottom[src] + bottom[src + 4] + 2) >> 2);
+			}
+			continue;
+		}
+		
+		// each run of 4 pixels is one row of a block, and the next block is 64 bytes on
+		unsigned char* dst = to + ((((y >> 2) * toWidth) + (y & 0x3)) << 4);
+		for (unsigned int run = 0; run < (toWidth << 2); run += 16, dst += 64) {
+			for (unsigned int k = 0; k < 16; k++) {
+				unsigned int src = ((run + k) << 1) - (k & 0x3);
+				dst[k] = (unsigned char)((top[src] + top[src + 4] + bottom[src] + bottom[src + 4] + 2) >> 2);
+			}
+		}
+	}
+	return true;
+}
+
+// Fraction of pixels, out of 65536, that an alpha test at half opacity keeps once alpha is scaled by scale / 256
+unsigned int alphaCoverage(unsigned char* image, unsigned int pixels, unsigned int scale) {
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < pixels; i++) {
+		if (((image[(i << 2) + 3] * scale) >> 8) >= 128)
+			kept++;
+	}
+	return (unsigned int)(((unsigned long long)kept << 16) / pixels);
+}
+
+// --max-size applies to everything but the lossless rewrap and transforms
+bool ConversionJob::needsShrink() {
+	if (options->maxSize == 0 || width <= options->maxSize || outputTransform != XFORM_NONE)
+		return false;
+	if (autoOutput)
+		return true;
+	return outputFileType != UNKN && !(outputFileType == inputFileType && outputContainer != inputContainer);
+}
+
+// Decodes the input and halves it with a box filter until it is at most maxSize wide.  The result
+// replaces the input as a standard 32-bit image, turned bottom-up already if it came from DDS.
+// Averaging thins out alpha-tested edges, so alpha is then scaled until the share of pixels
+// passing a half-opacity test matches the original.
+// An image bound for a block format (or for --auto, which picks one unless the colours need
+// FS_32) is left in 4x4 tiles by the last halving, so the encoder reads each block as one run.
+bool ConversionJob::shrinkInput(unsigned int maxSize) {
+	unsigned char* image = allocBuffer(width * height * 4);
+	if (!conv_fused_from_input<Dst_32>(inputFileBuffer, image)) {
+		releaseBuffer(image);
+		return false;
+	}
+	if (inputContainer != outputContainer)
+		transformLevel(image, STD_32, width, height, XFORM_FLIP);
+	unsigned int fromWidth = width;
+	unsigned int coverage = alphaCoverage(image, width * height, 256);
+	bool tiled = autoOutput || isBlockCompressed(outputFileType);
+	
+	while (width > maxSize && width > 4) {
+		unsigned char* half = allocBuffer((width >> 1) * (height >> 1) * 4);
+		bool last = (width >> 1) <= maxSize || (width >> 1) <= 4;
+		box_downscale_32(image, half, width, height, tiled && last);
+		releaseBuffer(image);
+		image = half;
+		width >>= 1;
+		height >>= 1;
+		if (normalMap && options->renormalize)
+			renormalize_32(image, width * height);
+	}
+	
+	// coverage only falls as the scale falls, so search for the smallest scale that reaches it;
+	// a normal map's alpha means nothing
+	if (!normalMap && coverage != 0 && coverage != 65536) {
+		unsigned int low = 0, high = 256 * 8;
+		while (low < high) {
+			unsigned int mid = (low + high) >> 1;
+			if (alphaCoverage(image, width * height, mid) >= coverage)
+				high = mid;
+			else
+				low = mid + 1;
+		}
+		// a step can overshoot when many pixels share one alpha; take whichever side is nearer
+		if (low > 0 && coverage - alphaCoverage(image, width * height, low - 1) < alphaCoverage(image, width * height, low) - coverage)
+			low--;
+		for (unsigned int i = 0; i < width * height; i++) {
+			unsigned int alpha = (image[(i << 2) + 3] * low) >> 8;
+			image[(i << 2) + 3] = (unsigned char)(alpha > 255 ? 255 : alpha);
+		}
+	}
+	
+	releaseBuffer(inputFileBuffer);
+	inputFileBuffer = image;
+	inputFileType = STD_32;
+	tiledInput = tiled;
+	inputPayloadSize = width * height * 4;
+	inputBufferSize = inputPayloadSize;
+	inputMipLevels = 1;
+	mips = false;
+	report("\tResized from %ux%u to %ux%u.\n", fromWidth, fromWidth, width, height);
+	return true;
+}
+
+// Builds a small 24-bit bitmap whose longest side is at most maxSize, replacing the image dimensions
+bool ConversionJob::makePreview(unsigned int maxSize) {
+	unsigned int previewWidth = width >> 2;
+	unsigned int previewHeight = height >> 2;
+	unsigned char* preview = (unsigned char*)malloc(previewWidth * previewHeight * 4 * sizeof(unsigned char));
+	if (!conv_preview_from_input(inputFileBuffer, preview)) {
+		free(preview);
+		return false;
+	}
+	
+	while ((previewWidth > maxSize || previewHeight > maxSize) && previewWidth > 1 && previewHeight > 1) {
+		unsigned char* half = (unsigned char*)malloc((previewWidth >> 1) * (previewHeight >> 1) * 4 * sizeof(unsigned char));
+		box_downscale_32(preview, half, previewWidth, previewHeight, false);
+		free(preview);
+		preview = half;
+		previewWidth >>= 1;
+		previewHeight >>= 1;
+	}
+	
+	width = previewWidth;
+	height = previewHeight;
+	outputFileType = STD_24;
+	outputMipLevels = 1;
+	
+	// bitmap rows are padded to 4 bytes, which matters for previews narrower than 4 pixels
+	unsigned int stride = (width * 3 + 3) & ~0x3u;
+	outputBufferSize = stride * height;
+	outputFileBuffer = allocBuffer(outputBufferSize);
+	memset(outputFileBuffer, 0, outputBufferSize);
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			outputFileBuffer[y * stride + x * 3] = preview[(y * width + x) << 2];
+			outputFileBuffer[y * stride + x * 3 + 1] = preview[((y * width + x) << 2) + 1];
+			outputFileBuffer[y * stride + x * 3 + 2] = preview[((y * width + x) << 2) + 2];
+		}
+	}
+	free(preview);
+	
+	makeOutputHeader_STD_24();
+	return true;
+}
+
+// Sums up the per-block statistics of the input image
+void ConversionJob::analyzeImage(ImageStats* result) {
+	unsigned int blocks = (width * height) >> 4;
+	BlockStats* stats = (BlockStats*)malloc(blocks * sizeof(BlockStats));
+	conv_fused_from_input<Dst_stats>(inputFileBuffer, (unsigned char*)stats);
+	
+	result->opaque = true;
+	result->binaryAlpha = true;
+	result->alphaErrorDXT3 = 0;
+	result->alphaErrorDXT5 = 0;
+	unsigned long long colorErrorSum = 0;
+	for (unsigned int i = 0; i < blocks; i++) {
+		result->opaque = result->opaque && stats[i].minAlpha == 255;
+		result->binaryAlpha = result->binaryAlpha && stats[i].binaryAlpha;
+		if (stats[i].alphaErrorDXT3 > result->alphaErrorDXT3)
+			result->alphaErrorDXT3 = stats[i].alphaErrorDXT3;
+		// eight levels spread over the block's range
+		unsigned int errorDXT5 = (stats[i].maxAlpha - stats[i].minAlpha + 13) / 14;
+		if (errorDXT5 > result->alphaErrorDXT5)
+			result->alphaErrorDXT5 = errorDXT5;
+		colorErrorSum += stats[i].colorError;
+	}
+	free(stats);
+	result->colorError = (unsigned int)(colorErrorSum / blocks);
+}
+
+// Picks the smallest Flight Simulator format whose estimated error stays within AUTO_MAX_ERROR, and reports why
+int ConversionJob::chooseOutputType() {
+	ImageStats stats;
+	analyzeImage(&stats);
+	bool opaque = stats.opaque, binary = stats.binaryAlpha;
+	unsigned int alphaErrorDXT3 = stats.alphaErrorDXT3, alphaErrorDXT5 = stats.alphaErrorDXT5;
+	unsigned int colorError = stats.colorError;
+	
+	int type;
+	if (colorError > AUTO_MAX_ERROR) {
+		type = FS_32;
+		report("\tAutomatic choice: %s (average colour error %u would exceed %u)\n", filetype[type], colorError, AUTO_MAX_ERROR);
+	} else if (opaque) {
+		type = FS_DXT1;
+		report("\tAutomatic choice: %s (opaque)\n", filetype[type]);
+	} else if (binary) {
+		type = FS_DXT1A;
+		report("\tAutomatic choice: %s (1-bit alpha)\n", filetype[type]);
+	} else {
+		type = alphaErrorDXT5 <= alphaErrorDXT3 ? FS_DXT5 : FS_DXT3;
+		if ((alphaErrorDXT5 < alphaErrorDXT3 ? alphaErrorDXT5 : alphaErrorDXT3) > AUTO_MAX_ERROR)
+			type = FS_32;
+		report("\tAutomatic choice: %s (alpha error %u as DXT3, %u as DXT5)\n", filetype[type], alphaErrorDXT3, alphaErrorDXT5);
+	}
+	return type;
+}
+
+// 565 without alpha, 1555 for 1-bit alpha, otherwise 4444
+int ConversionJob::chooseLayout() {
+	ImageStats stats;
+	analyzeImage(&stats);
+	int layout = stats.opaque ? LAYOUT_565 : stats.binaryAlpha ? LAYOUT_1555 : LAYOUT_4444;
+	report("\t16-bit layout: %s (%s)\n", layoutNames[layout], stats.opaque ? "opaque" : stats.binaryAlpha ? "1-bit alpha" : "alpha");
+	return layout;
+}
+
+// Converts straight from the input format to the output in one pass.  Row-major 32-bit input
+// already holds FS_32 pixels, so its top level is handed over as it is.
+bool ConversionJob::convertFusedToOutput() {
+	outputMipLevels = 1;
+	outputBufferSize = levelSize(outputFileType, width, height);
+	if (outputFileType == FS_32 && (inputFileType == STD_32 || inputFileType == FS_32) && !tiledInput) {
+		makeOutputHeader_FS_32();
+		outputFileBuffer = inputFileBuffer;
+		inputFileBuffer = NULL;
+		return true;
+	}
+	
+	outputFileBuffer = allocBuffer(outputBufferSize);
+	switch (outputFileType) {
+	case STD_24:
+		makeOutputHeader_STD_24();
+		return conv_fused_from_input<Dst_24>(inputFileBuffer, outputFileBuffer);
+	case FS_32:
+		makeOutputHeader_FS_32();
+		return conv_fused_from_input<Dst_32>(inputFileBuffer, outputFileBuffer);
+	case FS_DXT1:
+		makeOutputHeader_FS_dxt(FS_DXT1);
+		return conv_fused_from_input<Dst_dxt1<false> >(inputFileBuffer, outputFileBuffer);
+	case FS_DXT1A:
+		makeOutputHeader_FS_dxt(FS_DXT1A);
+		return conv_fused_from_input<Dst_dxt1<true> >(inputFileBuffer, outputFileBuffer);
+	case FS_DXT3:
+		makeOutputHeader_FS_dxt(FS_DXT3);
+		return conv_fused_from_input<Dst_dxt3>(inputFileBuffer, outputFileBuffer);
+	case FS_DXT5:
+		makeOutputHeader_FS_dxt(FS_DXT5);
+		if (normalMap)
+			return conv_fused_from_input<Dst_dxt5nm>(inputFileBuffer, outputFileBuffer);
+		return conv_fused_from_input<Dst_dxt5>(inputFileBuffer, outputFileBuffer);
 	case MASK_16:
-		return conv_mask16_to_32(inputFileBuffer, convertFileBuffer);
+		if (outputLayout == LAYOUT_AUTO)
+			outputLayout = chooseLayout();
+		makeOutputHeader_MASK_16();
+		return conv_fused_from_input<Dst_mask16>(inputFileBuffer, outputFileBuffer);
 	default:
 		return false;
 	}
 }
 
-void makeOutputHeader_FS_dxt3() {
-	outputHeaderSize = 74;
-	outputFileSize = outputHeaderSize + outputBufferSize;
-	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
-	outputHeaderBuffer[0] = 'B';
-	outputHeaderBuffer[1] = 'M';
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
-	outputHeaderBuffer[10] = (unsigned char)0x4a; // index where image starts 74
-	outputHeaderBuffer[14] = (unsigned char)0x28;
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
-	outputHeaderBuffer[26] = (unsigned char)0x1;
-	outputHeaderBuffer[28] = (unsigned char)0x10; // bitdepth 16
-	outputHeaderBuffer[30] = 'D';
-	outputHeaderBuffer[31] = 'X';
-	outputHeaderBuffer[32] = 'T';
-	outputHeaderBuffer[33] = '3';
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
+// 24- and 32-bit bitmaps differ only by the alpha byte, so they are converted where they lie
+bool ConversionJob::canConvertInPlace() {
+	if (outputFileType == FS_32)
+		return inputFileType == STD_24;
+	if (outputFileType == STD_24)
+		return (inputFileType == STD_32 || inputFileType == FS_32) && !tiledInput;
+	return false;
+}
+
+bool ConversionJob::convertInPlace() {
+	outputMipLevels = 1;
+	outputBufferSize = levelSize(outputFileType, width, height);
+	if (outputFileType == FS_32) {
+		unsigned char* grown = growBuffer(inputFileBuffer, outputBufferSize);
+		if (grown == NULL)
+			return false;
+		inputFileBuffer = grown;
+		expand_24_to_32_in_place(inputFileBuffer);
+		makeOutputHeader_FS_32();
+	} else {
+		compact_32_to_24_in_place(inputFileBuffer);
+		makeOutputHeader_STD_24();
+	}
+	outputFileBuffer = inputFileBuffer;
+	inputFileBuffer = NULL;
+	return true;
+}
+
+bool ConversionJob::canRewrap() {
+	return inputFileType == STD_24 || inputFileType == STD_32 || inputFileType == FS_32 || isBlockCompressed(inputFileType);
+}
+
+// Moves the input payload, mip levels included, into the requested container without re-encoding,
+// applying outputTransform on the way
+bool ConversionJob::rewrapToOutput() {
+	if (!canRewrap())
+		return false;
+	
+	outputMipLevels = inputMipLevels;
+	// Standard bitmaps have nowhere to keep mips (convert has already moved 32-bit to FS_32)
+	if (outputContainer == CONT_BMP && inputContainer != CONT_BMP && outputFileType == STD_24)
+		outputMipLevels = 1;
+	
+	// Bitmaps store rows bottom-up and DDS top-down, so a change of container flips the image
+	int transform = outputTransform;
+	if (outputContainer != inputContainer)
+		transform ^= XFORM_FLIP;
+	
+	outputBufferSize = mipChainSize(inputFileType, outputMipLevels);
+	outputFileBuffer = inputFileBuffer;
+	inputFileBuffer = NULL;
+	transformPayload(outputFileBuffer, inputFileType, outputMipLevels, transform);
+	
+	if (outputContainer == CONT_DDS)
+		makeOutputHeader_DDS();
+	else if (outputFileType == FS_32)
+		makeOutputHeader_FS_32();
+	else if (outputFileType == STD_32)
+		makeOutputHeader_STD_32();
+	else if (outputFileType == STD_24)
+		makeOutputHeader_STD_24();
+	else
+		makeOutputHeader_FS_dxt(outputFileType);
+	return true;
+}
+
+// Standard and Flight Simulator 32-bit bitmaps store the same pixels and differ only in the header
+bool ConversionJob::canCopyPayload() {
+	return bmpFile != NULL && streamBuffer == NULL && (outputPath == NULL || strcmp(outputPath, "-") != 0) && inputContainer == CONT_BMP && outputContainer == CONT_BMP && outputTransform == XFORM_NONE
+		&& ((inputFileType == STD_32 && outputFileType == FS_32) || (inputFileType == FS_32 && outputFileType == STD_32))
+		&& inputPayloadSize == mipChainSize(inputFileType, inputMipLevels);
+}
+
+// Writes the new header to a temporary file, copies the payload straight from the input file
+// after it and renames the result over outputFilename.  On Linux the copy stays in the kernel
+// (copy_file_range, which lets the file system share extents where it can, else sendfile).
+bool ConversionJob::copyPayloadToOutput(const char* outputFilename) {
+	outputMipLevels = inputMipLevels;
+	outputBufferSize = inputPayloadSize;
+	if (outputFileType == FS_32)
+		makeOutputHeader_FS_32();
+	else
+		makeOutputHeader_STD_32();
+	
+	size_t nameLength = strlen(outputFilename);
+	char* tempFilename = (char*)malloc(nameLength + 5);
+	memcpy(tempFilename, outputFilename, nameLength);
+	memcpy(tempFilename + nameLength, ".tmp", 5);
+	
+	bool written = false;
+#if !defined(_WIN32) && !defined(WIN32)
+	// the result replaces the input, so it keeps the input's permissions
+	struct stat inputInfo;
+	bool keepMode = fstat(fileno(bmpFile), &inputInfo) == 0;
+#endif
+#if defined(__linux__)
+	int out = open(tempFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out >= 0) {
+		written = write(out, outputHeaderBuffer, outputHeaderSize) == (ssize_t)outputHeaderSize;
+		if (keepMode && fchmod(out, inputInfo.st_mode & 07777) != 0)
+			written = false;
+		
+		int in = fileno(bmpFile);
+		loff_t inOffset = inputDataOffset;
+		size_t remaining = outputBufferSize;
+		bool useSendfile = false;
+		while (written && remaining > 0) {
+			ssize_t copied;
+			if (!useSendfile) {
+				copied = copy_file_range(in, &inOffset, out, NULL, remaining, 0);
+				// not supported by this kernel or across these file systems
+				if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+					useSendfile = true;
+					continue;
+				}
+			} else {
+				off_t sendOffset = (off_t)inOffset;
+				copied = sendfile(out, in, &sendOffset, remaining);
+				inOffset = sendOffset;
+			}
+			if (copied <= 0)
+				written = false;
+			else
+				remaining -= copied;
+		}
+		if (close(out) != 0)
+			written = false;
+	}
+#else
+	FILE* out;
+#if defined(_WIN32) || defined(WIN32)
+	fopen_s(&out, tempFilename, "wb");
+#else
+	out = fopen(tempFilename, "wb");
+#endif
+	if (out != NULL) {
+		written = fwrite(outputHeaderBuffer, 1, outputHeaderSize, out) == outputHeaderSize;
+#if !defined(_WIN32) && !defined(WIN32)
+		if (keepMode && fchmod(fileno(out), inputInfo.st_mode & 07777) != 0)
+			written = false;
+#endif
+		
+		unsigned char copyBuffer[65536];
+		size_t remaining = outputBufferSize;
+		while (written && remaining > 0) {
+			size_t chunk = remaining < sizeof(copyBuffer) ? remaining : sizeof(copyBuffer);
+			written = fread(copyBuffer, 1, chunk, bmpFile) == chunk && fwrite(copyBuffer, 1, chunk, out) == chunk;
+			remaining -= chunk;
+		}
+		if (fclose(out) != 0)
+			written = false;
+	}
+#endif
+	
+	fclose(bmpFile);
+	bmpFile = NULL;
+	
+#if defined(_WIN32) || defined(WIN32)
+	if (written)
+		remove(outputFilename);
+#endif
+	if (written && rename(tempFilename, outputFilename) != 0)
+		written = false;
+	if (!written)
+		remove(tempFilename);
+	free(tempFilename);
+	
+	if (!written) {
+		report("\tWrite error: %s\n", outputFilename);
+		return false;
+	}
+	report("\tWrite OK: %s\n", outputFilename);
+	return true;
+}
+
+// Returns filename with its extension replaced by ext; the caller frees the result
+char* replaceExtension(const char* filename, const char* ext) {
+	const char* dot = strrchr(filename, '.');
+	const char* separator = strrchr(filename, '/');
+	const char* backslash = strrchr(filename, '\\');
+	if (backslash > separator)
+		separator = backslash;
+	size_t baseLength = (dot != NULL && dot > separator) ? (size_t)(dot - filename) : strlen(filename);
+	
+	char* result = (char*)malloc(baseLength + strlen(ext) + 1);
+	memcpy(result, filename, baseLength);
+	memcpy(result + baseLength, ext, strlen(ext) + 1);
+	return result;
+}
+
+bool ConversionJob::writeOutputFile(unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize) {
+	if (header == NULL || data == NULL)
+		return false;
+	if (fwrite(header, 1, headerSize, bmpFile) != headerSize)
+		return false;
+	if (fwrite(data, 1, dataSize, bmpFile) != dataSize)
+		return false;
+	return true;
+}
+
+// Asks the kernel to start reading a file we will open soon, so its data is
+// already in the page cache by the time we get to it.  Does nothing where unsupported.
+void prefetchFile(const char* name) {
+#if defined(__linux__)
+	if (strcmp(name, "-") == 0)
+		return;
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
+}
+
+// Batch read-ahead: while files convert, the next --io-depth files are read whole into memory
+// through one io_uring with all of their reads in flight at once.  Files are handed out in batch
+// order, each with its buffer, to whichever job starts next, so a job does not read its file
+// itself.  Slot s holds the files s, s + depth, s + 2 * depth and so on in turn.  The ring is
+// driven with raw system calls, so liburing is not needed.  Where io_uring is missing (other
+// systems, kernels before 5.6, or sandboxes that forbid it) jobs read their own files after a
+// prefetchFile hint.
+#define READ_AHEAD_MAX_DEPTH 64
+
+struct ReadAheadSlot {
+	int fd;
+	unsigned char* buffer; // from malloc, since it becomes the job's streamBuffer
+	unsigned int size;
+	unsigned int done; // bytes read so far
+	bool finished; // read completely, or failed and left for the job to read itself
+};
+
+struct ReadAheadQueue {
+	int ring; // io_uring descriptor, -1 when read-ahead is off
+#if defined(__linux__)
+	unsigned char* sqRing;
+	size_t sqRingSize;
+	unsigned char* cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned int* sqTail;
+	unsigned int* sqMask;
+	unsigned int* sqArray;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int* cqMask;
+	struct io_uring_cqe* cqes;
+#endif
+	ReadAheadSlot slots[READ_AHEAD_MAX_DEPTH];
+	int slotCount;
+	char** files;
+	int fileCount;
+	int queued; // files whose reads have been started
+	int handedOut; // files given to jobs
+};
+ReadAheadQueue readAhead;
+
+#if defined(__linux__)
+// Hands the rest of a slot's file to the kernel; false if the ring would not take it
+bool submitReadAhead(int s) {
+	ReadAheadSlot* slot = &readAhead.slots[s];
+	unsigned int tail = *readAhead.sqTail;
+	unsigned int index = tail & *readAhead.sqMask;
+	struct io_uring_sqe* sqe = &readAhead.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long long)(size_t)(slot->buffer + slot->done);
+	sqe->len = slot->size - slot->done;
+	sqe->off = slot->done;
+	sqe->user_data = (unsigned long long)s;
+	readAhead.sqArray[index] = index;
+	__atomic_store_n(readAhead.sqTail, tail + 1, __ATOMIC_RELEASE);
+	
+	int submitted;
+	do
+		submitted = (int)syscall(__NR_io_uring_enter, readAhead.ring, 1, 0, 0, NULL, 0);
+	while (submitted < 0 && errno == EINTR);
+	return submitted == 1;
+}
+#endif
+
+// Gives up on reading a slot's file ahead; its job will open and read the file as usual
+void abandonReadAhead(ReadAheadSlot* slot) {
+	free(slot->buffer);
+	slot->buffer = NULL;
+	slot->finished = true;
+}
+
+// Starts reading the next file of the batch into slot s, which is free
+void queueReadAhead(int s) {
+	if (readAhead.queued == readAhead.fileCount)
+		return;
+	int file = readAhead.queued++;
+	ReadAheadSlot* slot = &readAhead.slots[s];
+	slot->fd = -1;
+	slot->buffer = NULL;
+	slot->size = 0;
+	slot->done = 0;
+	slot->finished = false;
+	
+#if defined(__linux__)
+	// standard input is read by its job, which has to wait for it anyway
+	const char* name = readAhead.files[file];
+	struct stat info;
+	if (strcmp(name, "-") == 0 || (slot->fd = open(name, O_RDONLY)) < 0 || fstat(slot->fd, &info) != 0
+		|| info.st_size <= 0 || (unsigned long long)info.st_size > UINT_MAX) {
+		abandonReadAhead(slot);
+		return;
+	}
+	slot->size = (unsigned int)info.st_size;
+	slot->buffer = (unsigned char*)malloc(slot->size);
+	if (slot->buffer == NULL || !submitReadAhead(s))
+		abandonReadAhead(slot);
+#else
+	abandonReadAhead(slot);
+#endif
+}
+
+// Takes in the completed reads, waiting for one first if wait is set
+void reapReadAhead(bool wait) {
+#if defined(__linux__)
+	if (wait) {
+		int waited;
+		do
+			waited = (int)syscall(__NR_io_uring_enter, readAhead.ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		while (waited < 0 && errno == EINTR);
+	}
+	
+	unsigned int head = *readAhead.cqHead;
+	while (head != __atomic_load_n(readAhead.cqTail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &readAhead.cqes[head & *readAhead.cqMask];
+		int s = (int)cqe->user_data;
+		int result = cqe->res;
+		head++;
+		
+		ReadAheadSlot* slot = &readAhead.slots[s];
+		if (result > 0)
+			slot->done += result;
+		// a large file can arrive in several pieces; a file that shrank is left to its job
+		if (result > 0 && slot->done == slot->size)
+			slot->finished = true;
+		else if ((result > 0 || result == -EINTR || result == -EAGAIN) && submitReadAhead(s))
+			continue;
+		else
+			abandonReadAhead(slot);
+	}
+	__atomic_store_n(readAhead.cqHead, head, __ATOMIC_RELEASE);
+#else
+	(void)wait;
+#endif
+}
+
+// Sets up the ring and starts reading the first files of the batch.  Returns false, leaving
+// read-ahead off, where io_uring cannot be had or --io-depth is 0.
+bool startReadAhead(char* files[], int fileCount) {
+	readAhead.ring = -1;
+	readAhead.slotCount = (int)ioDepth < fileCount ? (int)ioDepth : fileCount;
+	if (readAhead.slotCount > READ_AHEAD_MAX_DEPTH)
+		readAhead.slotCount = READ_AHEAD_MAX_DEPTH;
+	if (readAhead.slotCount == 0)
+		return false;
+	
+#if defined(__linux__)
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring = (int)syscall(__NR_io_uring_setup, readAhead.slotCount, &params);
+	if (ring < 0)
+		return false;
+	
+	readAhead.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	readAhead.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	readAhead.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqRing = mmap(NULL, readAhead.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	void* cqRing = mmap(NULL, readAhead.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	void* sqes = mmap(NULL, readAhead.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, readAhead.sqRingSize);
+		if (cqRing != MAP_FAILED)
+			munmap(cqRing, readAhead.cqRingSize);
+		if (sqes != MAP_FAILED)
+			munmap(sqes, readAhead.sqesSize);
+		close(ring);
+		return false;
+	}
+	
+	readAhead.ring = ring;
+	readAhead.sqRing = (unsigned char*)sqRing;
+	readAhead.cqRing = (unsigned char*)cqRing;
+	readAhead.sqes = (struct io_uring_sqe*)sqes;
+	readAhead.sqTail = (unsigned int*)(readAhead.sqRing + params.sq_off.tail);
+	readAhead.sqMask = (unsigned int*)(readAhead.sqRing + params.sq_off.ring_mask);
+	readAhead.sqArray = (unsigned int*)(readAhead.sqRing + params.sq_off.array);
+	readAhead.cqHead = (unsigned int*)(readAhead.cqRing + params.cq_off.head);
+	readAhead.cqTail = (unsigned int*)(readAhead.cqRing + params.cq_off.tail);
+	readAhead.cqMask = (unsigned int*)(readAhead.cqRing + params.cq_off.ring_mask);
+	readAhead.cqes = (struct io_uring_cqe*)(readAhead.cqRing + params.cq_off.cqes);
+	
+	readAhead.files = files;
+	readAhead.fileCount = fileCount;
+	readAhead.queued = 0;
+	readAhead.handedOut = 0;
+	for (int s = 0; s < readAhead.slotCount; s++)
+		queueReadAhead(s);
+	return true;
+#else
+	(void)files;
+	return false;
+#endif
+}
+
+// Returns the index of the next file of the batch and sets buffer to the whole file, from
+// malloc, or to NULL if the job is to read it itself.  Waits for the read if it is still in
+// flight, then starts reading the file that takes its slot.
+int nextReadAhead(unsigned char** buffer, unsigned int* size) {
+	int file;
+#pragma omp critical(readAhead)
+	{
+		file = readAhead.handedOut++;
+		int s = file % readAhead.slotCount;
+		ReadAheadSlot* slot = &readAhead.slots[s];
+		reapReadAhead(false);
+		while (!slot->finished)
+			reapReadAhead(true);
+		*buffer = slot->buffer;
+		*size = slot->size;
+		if (slot->fd >= 0)
+			close(slot->fd);
+		queueReadAhead(s);
+	}
+	return file;
+}
+
+// Closes the ring once the batch is done
+void stopReadAhead() {
+#if defined(__linux__)
+	if (readAhead.ring < 0)
+		return;
+	// every file has been handed out, so no read is left in flight
+	munmap(readAhead.sqRing, readAhead.sqRingSize);
+	munmap(readAhead.cqRing, readAhead.cqRingSize);
+	munmap(readAhead.sqes, readAhead.sqesSize);
+	close(readAhead.ring);
+	readAhead.ring = -1;
+#endif
+}
+
+// Opens the named file, writes the output buffers to it and reports the outcome.
+// With --bundle the file goes into the bundle under that name instead.
+bool ConversionJob::saveOutputFile(const char* outputFilename) {
+	if (bundlePath != NULL)
+		return addToBundle(outputFilename, outputHeaderBuffer, outputHeaderSize, outputFileBuffer, outputBufferSize, outputFileType, outputContainer,
+			outputMipLevels, outputContainer == CONT_BMP && outputFileType >= FS_32 && outputFileType <= FS_DXT5);
+	return saveBuffers(outputFilename, outputHeaderBuffer, outputHeaderSize, outputFileBuffer, outputBufferSize);
+}
+
+// Opens the named file, or standard output for "-", writes a header and data to it and reports the outcome
+bool ConversionJob::saveBuffers(const char* outputFilename, unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize) {
+	bool toStream = strcmp(outputFilename, "-") == 0;
+	if (toStream) {
+		outputFilename = "standard output";
+		bmpFile = streamOutput;
+	} else {
+#if defined(_WIN32) || defined(WIN32)
+		fopen_s(&bmpFile, outputFilename, "wb");
+#else
+		bmpFile = fopen(outputFilename, "wb");
+#endif
+	}
+	
+	if (bmpFile == NULL) {
+		report("\tCould not open %s for writing.\n", outputFilename);
+		return false;
+	}
+	
+	// Write to output file
+	bool written = writeOutputFile(header, headerSize, data, dataSize);
+	if (toStream ? fflush(bmpFile) != 0 : fclose(bmpFile) != 0)
+		written = false;
+	bmpFile = NULL;
+	if (!written) {
+		report("\tWrite error: %s\n", outputFilename);
+		return false;
+	}
+	report("\tWrite OK: %s\n", outputFilename);
+	return true;
+}
+
+// Everything on standard input, in a malloc'd buffer; NULL if memory runs out or there is
+// more than an unsigned int can count
+unsigned char* readStandardInput(unsigned int* length) {
+#if defined(_WIN32) || defined(WIN32)
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	size_t capacity = 1 << 20;
+	size_t used = 0;
+	size_t got;
+	unsigned char* buffer = (unsigned char*)malloc(capacity);
+	if (buffer == NULL)
+		return NULL;
+	while ((got = fread(buffer + used, 1, capacity - used, stdin)) > 0) {
+		used += got;
+		if (used > UINT_MAX) {
+			free(buffer);
+			return NULL;
+		}
+		if (used == capacity) {
+			capacity <<= 1;
+			unsigned char* grown = (unsigned char*)realloc(buffer, capacity);
+			if (grown == NULL) {
+				free(buffer);
+				return NULL;
+			}
+			buffer = grown;
+		}
+	}
+	*length = (unsigned int)used;
+	return buffer;
+}
+
+// Opens the named file, or standard input for "-", and finds its size.  A pipe cannot seek,
+// so standard input is read into memory first and parsed from there.  A daemon request
+// hands its payload over in streamBuffer beforehand, and batch read-ahead a file it has read.
+bool ConversionJob::openInput(const char* name, bool headersOnly) {
+	inputPosition = 0;
+	inputIsStream = strcmp(name, "-") == 0;
+	if (!inputIsStream && streamBuffer == NULL) {
+#if defined(_WIN32) || defined(WIN32)
+		fopen_s(&bmpFile, name, "rb");
+#else
+		bmpFile = fopen(name, "rb");
+#endif
+		if (bmpFile == NULL)
+			return false;
+		
+		// the headers fit in one small read
+		if (headersOnly)
+			setvbuf(bmpFile, NULL, _IOFBF, 512);
+		
+		// get filesize
+		fseek(bmpFile, 0, SEEK_END);
+		inputFileSize = (unsigned int)ftell(bmpFile);
+		rewind(bmpFile);
+		return true;
+	}
+	
+	if (streamBuffer == NULL) {
+		streamBuffer = readStandardInput(&inputFileSize);
+		if (streamBuffer == NULL)
+			return false;
+	}
+	
+#if defined(_WIN32) || defined(WIN32)
+	// no fmemopen here; an unnamed temporary file stands in
+	bmpFile = tmpfile();
+	if (bmpFile != NULL) {
+		fwrite(streamBuffer, 1, inputFileSize, bmpFile);
+		rewind(bmpFile);
+	}
+#else
+	bmpFile = fmemopen(streamBuffer, inputFileSize > 0 ? inputFileSize : 1, "rb");
+#endif
+	return bmpFile != NULL;
+}
+
+// Explains an error code returned while reading input
+const char* inputErrorMessage(int code) {
+	switch (code) {
+	case 1:
+		return "File invalid.";
+	case 2:
+		return "File has a Flight Simulator header but is incompatible or corrupt.";
+	case 3:
+		return "File may be corrupt.";
+	case 4:
+		return "File must have same width and height.";
+	case 5:
+		return "File dimensions must be a power of 2 and greater than 4px.";
+	default:
+		return "Undefined error.";
+	}
+}
+
+// Most memory a conversion of the loaded file can hold at once, known from the headers alone:
+// the payload as read, a 32-bit working copy and an output no bigger than 32 bits a pixel.
+// Shrinking and previews stay within the same two pixel buffers; in-place conversion needs one.
+unsigned long long ConversionJob::peakFootprint() {
+	unsigned long long pixelBytes = (unsigned long long)width * height * 4;
+	unsigned long long footprint = inputPayloadSize + 2 * pixelBytes + 4096;
+	if (options->previewSize == 0 && !needsShrink() && canConvertInPlace())
+		footprint = (inputPayloadSize > pixelBytes ? inputPayloadSize : pixelBytes) + 4096;
+	if (streamBuffer != NULL)
+		footprint += inputFileSize;
+	return footprint;
+}
+
+// Opens the named file and reads it; reports why and returns false if it cannot be converted
+bool ConversionJob::load(const char* name) {
+	filename = name;
+	
+	// Open the specified file and check existence
+	if (!openInput(filename, false)) {
+		// File cannot be opened or does not exist, error.
+		report(inputIsStream ? "\tStandard input could not be read.\n" : "\tFile not found.\n");
+		return false;
+	}
+	
+	// standard input has nowhere to be written back to, so it goes to standard output
+	outputPath = options->output != NULL ? options->output : inputIsStream ? "-" : NULL;
+	
+	// File size less than 54 (the size of the smallest header) implies corrupt
+	if (inputFileSize < 54) {
+		report("\tFile invalid or corrupt.\n");
+		return false;
+	}
+	
+	// At this point, we will try to process the file.  The payload is
+	// read later, once we know whether the conversion needs it in memory.
+	int inputReadSuccess = processFileInput();
+	inputDataOffset = inputPosition;
+	
+	if (inputReadSuccess != 0) {
+		// File was not processed properly
+		report("\t%s\n", inputErrorMessage(inputReadSuccess));
+		return false;
+	}
+	
+	if (inputFileType == UNKN) {
+		report("\tUnsupported filetype.\n");
+		return false;
+	}
+	
+	report("\tRead OK.  File type: %s%s\n", filetype[inputFileType], inputContainer == CONT_DDS ? " (DDS)" : "");
+	if (mips)
+		report("\tWarning: the original file contains mipmaps. Note that the converted image will not have mipmaps unless it is only rewrapped.\n");
+	return true;
+}
+
+// Sets the output from a menu selection.
+// Returns 0 if accepted, 1 for an unknown selection, 2 if the file cannot be rewrapped, 3 if it cannot be transformed.
+int ConversionJob::selectOutput(char selection) {
+	outputFileType = UNKN;
+	outputContainer = CONT_BMP;
+	outputTransform = XFORM_NONE;
+	outputLayout = LAYOUT_AUTO;
+	outputDither = false;
+	autoOutput = false;
+	normalMap = false;
+	switch (selection) {
+	case '0':
+		return 0;
+	case '1':
+		outputFileType = FS_32;
+		return 0;
+	case '2':
+		outputFileType = FS_DXT3;
+		return 0;
+	case '3':
+		outputFileType = STD_24;
+		return 0;
+	case '4':
+		if (!canRewrap())
+			return 2;
+		outputFileType = inputFileType;
+		outputContainer = inputContainer == CONT_DDS ? CONT_BMP : CONT_DDS;
+		return 0;
+	case '5':
+	case '6':
+	case '7':
+		// lossless, done directly on the stored data
+		if (!canRewrap())
+			return 3;
+		outputFileType = inputFileType;
+		outputContainer = inputContainer;
+		outputTransform = selection == '5' ? XFORM_FLIP : selection == '6' ? XFORM_MIRROR : XFORM_ROTATE_180;
+		return 0;
+	case '8':
+		autoOutput = true;
+		return 0;
+	case '9':
+		outputFileType = MASK_16;
+		outputLayout = options->layout;
+		outputDither = options->dither;
+		return 0;
+	case 'n':
+		outputFileType = FS_DXT5;
+		normalMap = true;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+// --bundle packs the converted files into one file, so that whoever reads them opens and maps
+// one file instead of one per texture.  Everything in it is little-endian:
+//   0       64-byte header: "FSBUNDLE", version and entry count (4 bytes each), then the offsets
+//           of the index, the mip table and the names, and the size of the names (8 bytes each)
+//   64      the files one after another, each placed so that its pixel data starts on a page
+//   index   one 64-byte entry per file on a page boundary, sorted by the FNV-1a hash of the name,
+//           then the mip table (the bundle offset of every mip level, 8 bytes each) and the names,
+//           each followed by a zero byte
+// An entry is the name hash, the offset and size of the stored file (8 bytes each), then the
+// offset and length of the name, format, container, width, height, mip levels, header size,
+// first mip table slot and flags (4 bytes each).  A reader finds a file by binary search on the hash.
+#define BUNDLE_VERSION 1
+#define BUNDLE_PAGE 4096
+#define BUNDLE_HEADER_SIZE 64
+#define BUNDLE_ENTRY_SIZE 64
+#define BUNDLE_FS70 1 // entry flag: the bitmap carries an FS70 block
+
+// One file in a bundle
+struct BundleEntry {
+	char* name;
+	unsigned long long nameHash;
+	unsigned long long offset; // of the stored file; its pixel data starts headerSize bytes in
+	unsigned long long size;
+	unsigned int format;
+	unsigned int container;
+	unsigned int width;
+	unsigned int height;
+	unsigned int mipLevels;
+	unsigned int headerSize;
+	unsigned int flags;
+	unsigned int mipSlot; // first of mipLevels slots in the mip table
+	unsigned long long* mipOffsets; // while writing, the bundle offset of each level
+};
+
+// The bundle being written.  Files go in as their jobs finish; the index is written last.
+struct BundleWriter {
+	char* tempPath; // renamed to bundlePath once complete
+	FILE* file;
+	unsigned long long end; // where the next file may start
+	BundleEntry* entries;
+	int count;
+	int capacity;
+	bool failed;
+};
+BundleWriter bundleWriter;
+
+unsigned long long hashName(const char* name) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const unsigned char* c = (const unsigned char*)name; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+unsigned long long alignToPage(unsigned long long offset) {
+	return (offset + BUNDLE_PAGE - 1) & ~(unsigned long long)(BUNDLE_PAGE - 1);
+}
+
+// Writes size bytes at offset in the bundle.  Each job has its own stretch of the file, so
+// the writes need not take turns where there is pwrite.
+bool writeBundleAt(unsigned long long offset, const unsigned char* data, size_t size) {
+#if defined(_WIN32) || defined(WIN32)
+	bool written;
+#pragma omp critical(bundleWrite)
+	written = _fseeki64(bundleWriter.file, (__int64)offset, SEEK_SET) == 0 && fwrite(data, 1, size, bundleWriter.file) == size;
+	return written;
+#else
+	int fd = fileno(bundleWriter.file);
+	while (size > 0) {
+		ssize_t done = pwrite(fd, data, size, (off_t)offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return false;
+		data += done;
+		offset += done;
+		size -= done;
+	}
+	return true;
+#endif
+}
+
+// Creates the bundle as a temporary file next to bundlePath
+bool openBundle() {
+	size_t nameLength = strlen(bundlePath);
+	bundleWriter.tempPath = (char*)malloc(nameLength + 5);
+	memcpy(bundleWriter.tempPath, bundlePath, nameLength);
+	memcpy(bundleWriter.tempPath + nameLength, ".tmp", 5);
+#if defined(_WIN32) || defined(WIN32)
+	fopen_s(&bundleWriter.file, bundleWriter.tempPath, "wb");
+#else
+	bundleWriter.file = fopen(bundleWriter.tempPath, "wb");
+#endif
+	bundleWriter.end = BUNDLE_HEADER_SIZE;
+	bundleWriter.entries = NULL;
+	bundleWriter.count = 0;
+	bundleWriter.capacity = 0;
+	bundleWriter.failed = false;
+	if (bundleWriter.file == NULL) {
+		free(bundleWriter.tempPath);
+		return false;
+	}
+	return true;
+}
+
+// Whether a name stays below the current directory when written out
+bool isRelativeName(const char* name) {
+	if (name[0] == '\0' || name[0] == '/' || name[0] == '\\' || strchr(name, ':') != NULL)
+		return false;
+	for (const char* part = name; *part != '\0'; ) {
+		size_t partLength = strcspn(part, "/\\");
+		if (partLength == 2 && part[0] == '.' && part[1] == '.')
+			return false;
+		part += partLength;
+		if (*part != '\0')
+			part++;
+	}
+	return true;
+}
+
+// The name a file is stored under in a bundle: a relative name as it is, an absolute one by its
+// last part, so that --extract can write it out again.  NULL for a name that climbs out with "..".
+const char* bundleName(const char* name) {
+	if (name[0] == '/' || name[0] == '\\' || strchr(name, ':') != NULL) {
+		const char* base = name + strlen(name);
+		while (base > name && base[-1] != '/' && base[-1] != '\\' && base[-1] != ':')
+			base--;
+		name = base;
+	}
+	return isRelativeName(name) ? name : NULL;
+}
+
+// Stores a finished file in the bundle under its bundleName instead of writing it out
+bool ConversionJob::addToBundle(const char* name, unsigned char* header, unsigned int headerSize, unsigned char* data, unsigned int dataSize,
+	int fileType, int container, unsigned int levels, bool fs70) {
+	const char* stored = bundleName(name);
+	if (stored == NULL) {
+		report("\tNot stored: %s would lie outside the current directory when extracted.\n", name);
+		return false;
+	}
+	name = stored;
+	
+	BundleEntry entry;
+	size_t nameLength = strlen(name);
+	entry.name = (char*)malloc(nameLength + 1);
+	memcpy(entry.name, name, nameLength + 1);
+	entry.nameHash = hashName(name);
+	entry.size = (unsigned long long)headerSize + dataSize;
+	entry.format = fileType;
+	entry.container = container;
+	entry.width = width;
+	entry.height = height;
+	entry.mipLevels = levels;
+	entry.headerSize = headerSize;
+	entry.flags = fs70 ? BUNDLE_FS70 : 0;
+	entry.mipSlot = 0;
+	entry.mipOffsets = (unsigned long long*)malloc((levels > 0 ? levels : 1) * sizeof(unsigned long long));
+	for (unsigned int level = 0; level < levels; level++)
+		entry.mipOffsets[level] = mipChainSize(fileType, level);
+	
+#pragma omp critical(bundle)
+	{
+		// the file starts wherever puts its pixel data on a page boundary
+		entry.offset = alignToPage(bundleWriter.end + headerSize) - headerSize;
+		bundleWriter.end = entry.offset + entry.size;
+		if (bundleWriter.count == bundleWriter.capacity) {
+			bundleWriter.capacity = bundleWriter.capacity == 0 ? 1024 : bundleWriter.capacity * 2;
+			bundleWriter.entries = (BundleEntry*)realloc(bundleWriter.entries, bundleWriter.capacity * sizeof(BundleEntry));
+		}
+		for (unsigned int level = 0; level < levels; level++)
+			entry.mipOffsets[level] += entry.offset + headerSize;
+		bundleWriter.entries[bundleWriter.count++] = entry;
+	}
+	
+	if (!writeBundleAt(entry.offset, header, headerSize) || !writeBundleAt(entry.offset + headerSize, data, dataSize)) {
+#pragma omp critical(bundle)
+		bundleWriter.failed = true;
+		report("\tWrite error: %s in %s\n", name, bundlePath);
+		return false;
+	}
+	report("\tWrite OK: %s in %s\n", name, bundlePath);
+	return true;
+}
+
+// Stores the input file as it is, for a file that needs no conversion
+bool ConversionJob::addOriginalToBundle() {
+	unsigned char* whole = readOriginalFile();
+	if (whole == NULL) {
+		report("\t%s\n", inputErrorMessage(3));
+		return false;
+	}
+	bool added = addToBundle(filename, whole, inputDataOffset, whole + inputDataOffset, inputFileSize - inputDataOffset,
+		inputFileType, inputContainer, inputMipLevels, fsHeader);
+	releaseBuffer(whole);
+	return added;
+}
+
+// The whole input file, from the copy in memory or read again from disk, in a buffer from
+// allocBuffer; NULL if it cannot be read
+unsigned char* ConversionJob::readOriginalFile() {
+	unsigned char* whole = allocBuffer(inputFileSize);
+	if (streamBuffer != NULL) {
+		memcpy(whole, streamBuffer, inputFileSize);
+		return whole;
+	}
+	
+	FILE* original;
+#if defined(_WIN32) || defined(WIN32)
+	fopen_s(&original, filename, "rb");
+#else
+	original = fopen(filename, "rb");
+#endif
+	bool read = original != NULL && fread(whole, 1, inputFileSize, original) == inputFileSize;
+	if (original != NULL)
+		fclose(original);
+	if (!read) {
+		releaseBuffer(whole);
+		return NULL;
+	}
+	return whole;
+}
+
+// Writes the input file as it is to --output or standard output
+bool ConversionJob::copyOriginalToOutput(const char* outputFilename) {
+	unsigned char* whole = readOriginalFile();
+	if (whole == NULL) {
+		report("\t%s\n", inputErrorMessage(3));
+		return false;
+	}
+	bool saved = saveBuffers(outputFilename, whole, inputDataOffset, whole + inputDataOffset, inputFileSize - inputDataOffset);
+	releaseBuffer(whole);
+	return saved;
+}
+
+int compareBundleEntries(const void* a, const void* b) {
+	const BundleEntry* first = (const BundleEntry*)a;
+	const BundleEntry* second = (const BundleEntry*)b;
+	if (first->nameHash != second->nameHash)
+		return first->nameHash < second->nameHash ? -1 : 1;
+	return strcmp(first->name, second->name);
+}
+
+// Writes the index, mip table and names after the files and the header in front of them,
+// then renames the bundle into place.  Returns false if any part could not be written.
+bool closeBundle() {
+	BundleWriter* writer = &bundleWriter;
+	qsort(writer->entries, writer->count, sizeof(BundleEntry), compareBundleEntries);
+	
+	unsigned long long mipCount = 0;
+	unsigned long long namesSize = 0;
+	for (int i = 0; i < writer->count; i++) {
+		mipCount += writer->entries[i].mipLevels;
+		namesSize += strlen(writer->entries[i].name) + 1;
+	}
+	unsigned long long indexOffset = alignToPage(writer->end);
+	unsigned long long mipTableOffset = indexOffset + (unsigned long long)writer->count * BUNDLE_ENTRY_SIZE;
+	unsigned long long namesOffset = mipTableOffset + mipCount * 8;
+	size_t tableSize = (size_t)(namesOffset + namesSize - indexOffset);
+	unsigned char* table = (unsigned char*)calloc(tableSize > 0 ? tableSize : 1, 1);
+	
+	unsigned int mipSlot = 0;
+	unsigned int nameOffset = 0;
+	for (int i = 0; i < writer->count; i++) {
+		BundleEntry* entry = &writer->entries[i];
+		if (i > 0 && compareBundleEntries(entry - 1, entry) == 0)
+			printf("\nWarning: %s is in the bundle more than once; only one of them can be found by name.\n", entry->name);
+		
+		unsigned int nameLength = (unsigned int)strlen(entry->name);
+		unsigned int at = i * BUNDLE_ENTRY_SIZE;
+		bufferWriteLittleEndianLong(table, at, entry->nameHash);
+		bufferWriteLittleEndianLong(table, at + 8, entry->offset);
+		bufferWriteLittleEndianLong(table, at + 16, entry->size);
+		bufferWriteLittleEndianInt(table, at + 24, nameOffset);
+		bufferWriteLittleEndianInt(table, at + 28, nameLength);
+		bufferWriteLittleEndianInt(table, at + 32, entry->format);
+		bufferWriteLittleEndianInt(table, at + 36, entry->container);
+		bufferWriteLittleEndianInt(table, at + 40, entry->width);
+		bufferWriteLittleEndianInt(table, at + 44, entry->height);
+		bufferWriteLittleEndianInt(table, at + 48, entry->mipLevels);
+		bufferWriteLittleEndianInt(table, at + 52, entry->headerSize);
+		bufferWriteLittleEndianInt(table, at + 56, mipSlot);
+		bufferWriteLittleEndianInt(table, at + 60, entry->flags);
+		for (unsigned int level = 0; level < entry->mipLevels; level++)
+			bufferWriteLittleEndianLong(table, (unsigned int)(mipTableOffset - indexOffset) + (mipSlot + level) * 8, entry->mipOffsets[level]);
+		memcpy(table + (namesOffset - indexOffset) + nameOffset, entry->name, nameLength + 1);
+		mipSlot += entry->mipLevels;
+		nameOffset += nameLength + 1;
+	}
+	
+	unsigned char header[BUNDLE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, "FSBUNDLE", 8);
+	bufferWriteLittleEndianInt(header, 8, BUNDLE_VERSION);
+	bufferWriteLittleEndianInt(header, 12, writer->count);
+	bufferWriteLittleEndianLong(header, 16, indexOffset);
+	bufferWriteLittleEndianLong(header, 24, mipTableOffset);
+	bufferWriteLittleEndianLong(header, 32, namesOffset);
+	bufferWriteLittleEndianLong(header, 40, namesSize);
+	
+	bool written = !writer->failed && writeBundleAt(indexOffset, table, tableSize) && writeBundleAt(0, header, BUNDLE_HEADER_SIZE);
+	if (fclose(writer->file) != 0)
+		written = false;
+	free(table);
+	
+#if defined(_WIN32) || defined(WIN32)
+	if (written)
+		remove(bundlePath);
+#endif
+	if (written && rename(writer->tempPath, bundlePath) != 0)
+		written = false;
+	if (!written)
+		remove(writer->tempPath);
+	free(writer->tempPath);
+	
+	if (written)
+		printf("\nBundle %s written: %d files, %llu bytes.\n", bundlePath, writer->count, namesOffset + namesSize);
+	else
+		printf("\nBundle %s could not be written.\n", bundlePath);
+	for (int i = 0; i < writer->count; i++) {
+		free(writer->entries[i].name);
+		free(writer->entries[i].mipOffsets);
+	}
+	free(writer->entries);
+	return written;
+}
+
+// Converts the loaded file to the selected output and writes it
+bool ConversionJob::convert() {
+	bool shrink = needsShrink();
+	if (autoOutput || shrink) {
+		if (readInputPayload() != 0) {
+			report("\t%s\n", inputErrorMessage(3));
+			return false;
+		}
+		if (shrink && !shrinkInput(options->maxSize)) {
+			report("\tResize error. Original file unchanged.\n");
+			return false;
+		}
+		if (autoOutput)
+			outputFileType = chooseOutputType();
+	}
+	
+	// 16-bit with bit masks can be any layout, so it is always re-packed
+	bool sameFormat = outputFileType == inputFileType && outputFileType != MASK_16 && !normalMap;
+	if (outputFileType == UNKN || (sameFormat && outputContainer == inputContainer && outputTransform == XFORM_NONE)) {
+		// a bundle still needs the file
+		if (bundlePath != NULL)
+			return addOriginalToBundle();
+		// --output and standard output still expect the file
+		if (outputPath != NULL) {
+			report("\tNo conversion was required.  Writing the input unchanged.\n");
+			return copyOriginalToOutput(outputPath);
+		}
+		report("\tNo conversion was required.  Original file unchanged.\n");
+		return true;
+	}
+	
+	// Standard bitmaps have nowhere to keep mips; 32-bit rewrapped out of DDS goes to the Flight
+	// Simulator format which does
+	if (sameFormat && outputContainer == CONT_BMP && inputContainer != CONT_BMP && outputFileType == STD_32)
+		outputFileType = FS_32;
+	
+	report("\tOutput to file type: %s%s\n", filetype[outputFileType], outputContainer == CONT_DDS ? " (DDS)" : normalMap ? " (normal map)" : "");
+	
+	// Only the header differs, so the payload never has to leave the kernel
+	if (canCopyPayload() && bundlePath == NULL)
+		return copyPayloadToOutput(outputPath != NULL ? outputPath : filename);
+	
+	if (inputFileBuffer == NULL && readInputPayload() != 0) {
+		report("\t%s\n", inputErrorMessage(3));
+		return false;
+	}
+	
+	if (sameFormat) {
+		// Only the container changes, so the payload is carried over as-is
+		rewrapToOutput();
+	} else {
+		// DDS rows are top-down; turn them bottom-up for the bitmap output (shrinkInput already has)
+		if (inputContainer != outputContainer && !shrink)
+			transformPayload(inputFileBuffer, inputFileType, 1, XFORM_FLIP);
+		
+		bool converted = canConvertInPlace() ? convertInPlace() : convertFusedToOutput();
+		if (!converted) {
+			report("\tEncode error. Original file unchanged.\n");
+			return false;
+		}
+	}
+	
+	// --output or standard output, else a different container gets a new file next to the original
+	if (outputPath != NULL)
+		return saveOutputFile(outputPath);
+	if (outputContainer == inputContainer)
+		return saveOutputFile(filename);
+	
+	char* outputFilename = replaceExtension(filename, outputContainer == CONT_DDS ? ".dds" : ".bmp");
+	bool saved = saveOutputFile(outputFilename);
+	free(outputFilename);
+	return saved;
+}
+
+// Writes name_preview.bmp for the loaded file
+bool ConversionJob::writePreview(unsigned int maxSize) {
+	if (readInputPayload() != 0) {
+		report("\t%s\n", inputErrorMessage(3));
+		return false;
+	}
+	
+	// DDS rows are top-down; turn them bottom-up for the bitmap preview
+	if (inputContainer == CONT_DDS)
+		transformPayload(inputFileBuffer, inputFileType, 1, XFORM_FLIP);
+	
+	if (!makePreview(maxSize)) {
+		report("\tPreview error.\n");
+		return false;
+	}
+	
+	if (outputPath != NULL)
+		return saveOutputFile(outputPath);
+	char* outputFilename = replaceExtension(filename, "_preview.bmp");
+	bool saved = saveOutputFile(outputFilename);
+	free(outputFilename);
+	return saved;
+}
+
+// Appends text to the report with JSON string escaping, or CSV quote doubling
+void reportQuoted(ConversionJob* job, const char* text) {
+	job->report("\"");
+	for (const char* c = text; *c != 0; c++) {
+		if (inspectFormat == INSPECT_CSV)
+			job->report(*c == '"' ? "\"\"" : "%c", *c);
+		else if (*c == '"' || *c == '\\')
+			job->report("\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			job->report("\\u%04x", *c);
+		else
+			job->report("%c", *c);
+	}
+	job->report("\"");
+}
+
+// Reads only the headers of the named file and returns one --inspect record for it (malloc'd).
+// No pixel data is read: the size of the payload and its mip chain come from the headers and the file size.
+char* ConversionJob::inspect(const char* name) {
+	filename = name;
+	const char* error = NULL;
+	unsigned int dataOffset = 0;
+	
+	if (!openInput(filename, true)) {
+		error = inputIsStream ? "Standard input could not be read." : "File not found.";
+	} else {
+		int inputReadSuccess = 1;
+		if (inputFileSize >= 54)
+			inputReadSuccess = processFileInput();
+		if (inputReadSuccess != 0)
+			error = inputErrorMessage(inputReadSuccess);
+		else if (inputFileType == UNKN)
+			error = "Unsupported filetype.";
+		else
+			dataOffset = inputPosition;
+	}
+	
+	// drop anything the header parser printed
+	reportLength = 0;
+	return inspectRecord(error, dataOffset);
+}
+
+// Formats the --inspect record for what the job holds, or for the error, and hands it over (malloc'd)
+char* ConversionJob::inspectRecord(const char* error, unsigned int dataOffset) {
+	if (inspectFormat == INSPECT_CSV) {
+		reportQuoted(this, filename);
+		if (error != NULL) {
+			report(",error,,,,,,,,,,,");
+			reportQuoted(this, error);
+		} else {
+			report(",ok,%s,", inputContainer == CONT_DDS ? "dds" : "bmp");
+			reportQuoted(this, filetype[inputFileType]);
+			report(",%u,%u,%u,%d,%u,%u,%u,%u,", width, height, inputMipLevels, fsHeader ? 1 : 0,
+				inputFileSize, dataOffset, inputPayloadSize, inputFileSize - dataOffset - inputPayloadSize);
+		}
+		report("\n");
+	} else {
+		report("{\"file\":");
+		reportQuoted(this, filename);
+		if (error != NULL) {
+			report(",\"status\":\"error\",\"error\":");
+			reportQuoted(this, error);
+		} else {
+			report(",\"status\":\"ok\",\"container\":\"%s\",\"format\":", inputContainer == CONT_DDS ? "dds" : "bmp");
+			reportQuoted(this, filetype[inputFileType]);
+			report(",\"width\":%u,\"height\":%u,\"mipLevels\":%u,\"fs70\":%s", width, height, inputMipLevels, fsHeader ? "true" : "false");
+			report(",\"fileSize\":%u,\"headerSize\":%u,\"payloadSize\":%u,\"wastedBytes\":%u",
+				inputFileSize, dataOffset, inputPayloadSize, inputFileSize - dataOffset - inputPayloadSize);
+		}
+		report("}");
+	}
+	
+	char* record = reportBuffer;
+	reportBuffer = NULL;
+	reportLength = 0;
+	reportCapacity = 0;
+	return record;
+}
+
+// Best instruction set level this machine supports
+int detectCpuLevel() {
+#ifdef CPU_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return CPU_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return CPU_SSE41;
+#endif
+	return CPU_BASELINE;
+}
+
+void printVersion(int supported) {
+	printf("Build %s\n", BUILD_VERSION);
+#ifdef CPU_DISPATCH
+	printf("\tCPU supports: %s\n", cpuLevelNames[supported]);
+	printf("\tBlock converters (decoders, encoders, swizzles): %s%s\n", cpuLevelNames[cpuLevel], cpuRequest >= 0 ? " (--cpu)" : "");
+#else
+	printf("\tBlock converters (decoders, encoders, swizzles): %s (run-time dispatch not built in)\n", cpuLevelNames[cpuLevel]);
+#endif
+#ifdef _OPENMP
+	printf("\tThreads: %d\n", omp_get_max_threads());
+#endif
+}
+
+// Binds the calling thread to the index-th CPU this process may run on
+void pinThread(int index) {
+#if defined(__linux__)
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	int count = CPU_COUNT(&allowed);
+	if (count == 0)
+		return;
+	index %= count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			sched_setaffinity(0, sizeof(one), &one);
+			return;
+		}
+	}
+#endif
+}
+
+// Names accepted by --to, indexed by the matching menu selection
+const char* selectionNames[11] = { "none", "fs32", "dxt3", "std24", "rewrap", "flip", "mirror", "rotate", "auto", "mask16", "dxt5nm" };
+const char selectionKeys[12] = "0123456789n";
+
+// Pulls the options out of argv, leaving the file names in files.
+// Returns the number of files, or -1 if an option is invalid.
+// With jobOnly (a daemon request), options that concern the whole process are refused.
+int parseArguments(int argc, char* argv[], char* files[], JobOptions* options, bool jobOnly) {
+	int fileCount = 0;
+	options->selection = 0;
+	options->previewSize = 0;
+	options->maxSize = 0;
+	options->layout = LAYOUT_AUTO;
+	options->dither = false;
+	options->renormalize = false;
+	options->output = NULL;
+	if (!jobOnly) {
+		ioDepth = 4;
+		threadCount = 0;
+		pinThreads = false;
+		inspectFormat = INSPECT_NONE;
+		cpuRequest = -1;
+		showVersion = false;
+		memBudget = 0;
+		daemonPath = NULL;
+		clientPath = NULL;
+		bundlePath = NULL;
+		extractPath = NULL;
+		profiling = false;
+	}
+	for (int i = 1; i < argc; i++) {
+		if (jobOnly && (strcmp(argv[i], "--io-depth") == 0 || strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--pin") == 0
+			|| strcmp(argv[i], "--cpu") == 0 || strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "--inspect") == 0
+			|| strcmp(argv[i], "--daemon") == 0 || strcmp(argv[i], "--client") == 0 || strcmp(argv[i], "--mem-budget") == 0
+			|| strcmp(argv[i], "--bundle") == 0 || strcmp(argv[i], "--extract") == 0 || strcmp(argv[i], "--profile") == 0))
+			return -1;
+		if (strcmp(argv[i], "--preview") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+				return -1;
+			options->previewSize = (unsigned int)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--io-depth") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) < 0)
+				return -1;
+			ioDepth = (unsigned int)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+				return -1;
+			threadCount = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--pin") == 0) {
+			pinThreads = true;
+		} else if (strcmp(argv[i], "--to") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			i++;
+			for (int j = 0; j < 11; j++)
+				if (strcmp(argv[i], selectionNames[j]) == 0)
+					options->selection = selectionKeys[j];
+			if (options->selection == 0)
+				return -1;
+		} else if (strcmp(argv[i], "--cpu") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			i++;
+			for (int j = 0; j < 4; j++)
+				if (strcmp(argv[i], cpuLevelNames[j]) == 0)
+					cpuRequest = j;
+			if (cpuRequest < 0)
+				return -1;
+		} else if (strcmp(argv[i], "--layout") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			i++;
+			if (strcmp(argv[i], "auto") == 0)
+				options->layout = LAYOUT_AUTO;
+			else if (strcmp(argv[i], "565") == 0)
+				options->layout = LAYOUT_565;
+			else if (strcmp(argv[i], "1555") == 0)
+				options->layout = LAYOUT_1555;
+			else if (strcmp(argv[i], "4444") == 0)
+				options->layout = LAYOUT_4444;
+			else
+				return -1;
+		} else if (strcmp(argv[i], "--max-size") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) < 4)
+				return -1;
+			options->maxSize = (unsigned int)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			options->output = argv[++i];
+		} else if (strcmp(argv[i], "--mem-budget") == 0) {
+			// megabytes, or with a K, M or G suffix
+			if (i + 1 >= argc)
+				return -1;
+			char* unit;
+			memBudget = strtoull(argv[++i], &unit, 10);
+			if (*unit == 'K' || *unit == 'k')
+				memBudget <<= 10;
+			else if (*unit == 'G' || *unit == 'g')
+				memBudget <<= 30;
+			else if (*unit == '\0' || *unit == 'M' || *unit == 'm')
+				memBudget <<= 20;
+			else
+				return -1;
+			if (memBudget == 0)
+				return -1;
+		} else if (strcmp(argv[i], "--bundle") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			bundlePath = argv[++i];
+		} else if (strcmp(argv[i], "--extract") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			extractPath = argv[++i];
+#if defined(__linux__)
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profiling = true;
+#endif
+		} else if (strcmp(argv[i], "--renormalize") == 0) {
+			options->renormalize = true;
+		} else if (strcmp(argv[i], "--dither") == 0) {
+			options->dither = true;
+		} else if (strcmp(argv[i], "--version") == 0) {
+			showVersion = true;
+		} else if (strcmp(argv[i], "--auto") == 0) {
+			options->selection = '8';
+#if !defined(_WIN32) && !defined(WIN32)
+		} else if (strcmp(argv[i], "--daemon") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			daemonPath = argv[++i];
+		} else if (strcmp(argv[i], "--client") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			clientPath = argv[++i];
+#endif
+		} else if (strcmp(argv[i], "--inspect") == 0) {
+			if (i + 1 >= argc)
+				return -1;
+			i++;
+			if (strcmp(argv[i], "json") == 0)
+				inspectFormat = INSPECT_JSON;
+			else if (strcmp(argv[i], "csv") == 0)
+				inspectFormat = INSPECT_CSV;
+			else
+				return -1;
+		} else if (strncmp(argv[i], "--", 2) == 0) {
+			return -1;
+		} else {
+			files[fileCount++] = argv[i];
+		}
+	}
+	return fileCount;
+}
+
+// Standard input can be read once, and the menu would need it too;
+// --output names a single file
+bool checkFileArguments(char* files[], int fileCount, const JobOptions* options) {
+	int streamInputs = 0;
+	for (int i = 0; i < fileCount; i++)
+		if (strcmp(files[i], "-") == 0)
+			streamInputs++;
+	if (streamInputs > 1 || (options->output != NULL && fileCount != 1))
+		return false;
+	return streamInputs == 0 || inspectFormat != INSPECT_NONE || options->selection != 0 || options->previewSize > 0;
+}
+
+// Whether some result goes to standard output
+bool writesToStream(char* files[], int fileCount, const JobOptions* options) {
+	if (options->output != NULL)
+		return strcmp(options->output, "-") == 0;
+	for (int i = 0; i < fileCount; i++)
+		if (strcmp(files[i], "-") == 0)
+			return true;
+	return false;
+}
+
+// Records gathered by --inspect, one per file
+struct InspectIndex {
+	char** records;
+	int count;
+	int capacity;
+};
+
+void addInspectRecord(InspectIndex* index, char* record) {
+#pragma omp critical(inspect)
+	{
+		if (index->count == index->capacity) {
+			index->capacity = index->capacity == 0 ? 1024 : index->capacity * 2;
+			index->records = (char**)realloc(index->records, index->capacity * sizeof(char*));
+		}
+		index->records[index->count++] = record;
+	}
+}
+
+// Whether a file found while walking a directory looks like something we can read
+bool hasImageExtension(const char* name) {
+	const char* ext = strrchr(name, '.');
+	if (ext == NULL || strlen(ext) != 4)
+		return false;
+	char lower[5];
+	for (int i = 0; i < 5; i++)
+		lower[i] = (char)((ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] + 32 : ext[i]);
+	return strcmp(lower, ".bmp") == 0 || strcmp(lower, ".dds") == 0;
+}
+
+void inspectFile(InspectIndex* index, const char* name) {
+	ConversionJob job;
+	addInspectRecord(index, job.inspect(name));
+}
+
+// Inspects every .bmp and .dds below a directory; each subdirectory is a task of its own.
+// Returns false if path is not a directory.
+bool inspectDirectory(InspectIndex* index, const char* path) {
+	size_t pathLength = strlen(path);
+#if defined(_WIN32) || defined(WIN32)
+	char* pattern = (char*)malloc(pathLength + 3);
+	sprintf_s(pattern, pathLength + 3, "%s\\*", path);
+	WIN32_FIND_DATAA entry;
+	HANDLE dir = FindFirstFileA(pattern, &entry);
+	free(pattern);
+	if (dir == INVALID_HANDLE_VALUE)
+		return false;
+	do {
+		const char* name = entry.cFileName;
+		bool isDir = (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+		return false;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		const char* name = entry->d_name;
+		bool isDir = entry->d_type == DT_DIR;
+#endif
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		
+		size_t childLength = pathLength + strlen(name) + 2;
+		char* child = (char*)malloc(childLength);
+		sprintf(child, "%s/%s", path, name);
+#if !defined(_WIN32) && !defined(WIN32)
+		// some file systems do not fill in d_type
+		if (entry->d_type == DT_UNKNOWN) {
+			struct stat info;
+			isDir = stat(child, &info) == 0 && S_ISDIR(info.st_mode);
+		}
+#endif
+		
+		if (isDir) {
+#ifdef USE_TASKLOOP
+#pragma omp task firstprivate(child)
+#endif
+			{
+				inspectDirectory(index, child);
+				free(child);
+			}
+		} else {
+			if (hasImageExtension(name))
+				inspectFile(index, child);
+			free(child);
+		}
+#if defined(_WIN32) || defined(WIN32)
+	} while (FindNextFileA(dir, &entry));
+	FindClose(dir);
+#else
+	}
+	closedir(dir);
+#endif
+	return true;
+}
+
+// A bundle mapped into memory for reading
+struct MappedBundle {
+	unsigned char* data;
+	unsigned long long size;
+	unsigned int count;
+	unsigned long long indexOffset;
+	unsigned long long mipTableOffset;
+	unsigned long long namesOffset;
+	unsigned long long namesSize;
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+void unmapBundle(MappedBundle* bundle) {
+#if defined(_WIN32) || defined(WIN32)
+	UnmapViewOfFile(bundle->data);
+	CloseHandle(bundle->mapping);
+	CloseHandle(bundle->file);
+#else
+	munmap(bundle->data, (size_t)bundle->size);
+#endif
+}
+
+// Maps the named bundle and checks that its tables lie within it.
+// Returns 0 if done, 1 if the file cannot be opened, 2 if it is not a bundle or is damaged.
+int mapBundle(const char* path, MappedBundle* bundle) {
+#if defined(_WIN32) || defined(WIN32)
+	bundle->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (bundle->file == INVALID_HANDLE_VALUE)
+		return 1;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(bundle->file, &fileSize) || fileSize.QuadPart < BUNDLE_HEADER_SIZE) {
+		CloseHandle(bundle->file);
+		return 2;
+	}
+	bundle->size = (unsigned long long)fileSize.QuadPart;
+	bundle->mapping = CreateFileMappingA(bundle->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	bundle->data = bundle->mapping != NULL ? (unsigned char*)MapViewOfFile(bundle->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (bundle->data == NULL) {
+		if (bundle->mapping != NULL)
+			CloseHandle(bundle->mapping);
+		CloseHandle(bundle->file);
+		return 2;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < BUNDLE_HEADER_SIZE) {
+		close(fd);
+		return 2;
+	}
+	bundle->size = (unsigned long long)info.st_size;
+	void* data = mmap(NULL, (size_t)bundle->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 2;
+	bundle->data = (unsigned char*)data;
+#endif
+	
+	bundle->count = bufferReadLittleEndianInt(bundle->data, 12);
+	bundle->indexOffset = bufferReadLittleEndianLong(bundle->data, 16);
+	bundle->mipTableOffset = bufferReadLittleEndianLong(bundle->data, 24);
+	bundle->namesOffset = bufferReadLittleEndianLong(bundle->data, 32);
+	bundle->namesSize = bufferReadLittleEndianLong(bundle->data, 40);
+	if (memcmp(bundle->data, "FSBUNDLE", 8) != 0 || bufferReadLittleEndianInt(bundle->data, 8) != BUNDLE_VERSION
+		|| bundle->indexOffset > bundle->size || bundle->count > (bundle->size - bundle->indexOffset) / BUNDLE_ENTRY_SIZE
+		|| bundle->mipTableOffset != bundle->indexOffset + (unsigned long long)bundle->count * BUNDLE_ENTRY_SIZE
+		|| bundle->namesOffset < bundle->mipTableOffset || bundle->namesOffset > bundle->size
+		|| bundle->namesSize > bundle->size - bundle->namesOffset) {
+		unmapBundle(bundle);
+		return 2;
+	}
+	return 0;
+}
+
+// Reads the index-th entry of a mapped bundle; its name points into the mapping.
+// Returns false if the entry points outside the bundle.
+bool readBundleEntry(MappedBundle* bundle, unsigned int index, BundleEntry* entry) {
+	unsigned char* at = bundle->data + bundle->indexOffset + (unsigned long long)index * BUNDLE_ENTRY_SIZE;
+	entry->nameHash = bufferReadLittleEndianLong(at, 0);
+	entry->offset = bufferReadLittleEndianLong(at, 8);
+	entry->size = bufferReadLittleEndianLong(at, 16);
+	unsigned int nameOffset = bufferReadLittleEndianInt(at, 24);
+	unsigned int nameLength = bufferReadLittleEndianInt(at, 28);
+	entry->format = bufferReadLittleEndianInt(at, 32);
+	entry->container = bufferReadLittleEndianInt(at, 36);
+	entry->width = bufferReadLittleEndianInt(at, 40);
+	entry->height = bufferReadLittleEndianInt(at, 44);
+	entry->mipLevels = bufferReadLittleEndianInt(at, 48);
+	entry->headerSize = bufferReadLittleEndianInt(at, 52);
+	entry->mipSlot = bufferReadLittleEndianInt(at, 56);
+	entry->flags = bufferReadLittleEndianInt(at, 60);
+	entry->mipOffsets = NULL;
+	entry->name = (char*)bundle->data + bundle->namesOffset + nameOffset;
+	
+	unsigned long long mipCount = (bundle->namesOffset - bundle->mipTableOffset) / 8;
+	return (unsigned long long)nameOffset + nameLength < bundle->namesSize && entry->name[nameLength] == '\0'
+		&& entry->offset <= bundle->size && entry->size <= bundle->size - entry->offset && entry->headerSize <= entry->size
+		&& entry->format <= STD_INDEXED && (unsigned long long)entry->mipSlot + entry->mipLevels <= mipCount;
+}
+
+// Index of the entry stored under name, by binary search on the name hash; -1 if there is none
+int findBundleEntry(MappedBundle* bundle, const char* name) {
+	unsigned long long hash = hashName(name);
+	unsigned int low = 0;
+	unsigned int high = bundle->count;
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		if (bufferReadLittleEndianLong(bundle->data + bundle->indexOffset + (unsigned long long)middle * BUNDLE_ENTRY_SIZE, 0) < hash)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	// names that share a hash sit side by side
+	for (unsigned int i = low; i < bundle->count; i++) {
+		BundleEntry entry;
+		if (!readBundleEntry(bundle, i, &entry) || entry.nameHash != hash)
+			break;
+		if (strcmp(entry.name, name) == 0)
+			return (int)i;
+	}
+	return -1;
+}
+
+// Lists every file in a bundle, named bundle:name.  Returns false if path is not a bundle.
+bool inspectBundle(InspectIndex* index, const char* path) {
+	MappedBundle bundle;
+	if (mapBundle(path, &bundle) != 0)
+		return false;
+	for (unsigned int i = 0; i < bundle.count; i++) {
+		BundleEntry entry;
+		bool valid = readBundleEntry(&bundle, i, &entry);
+		size_t nameLength = strlen(path) + (valid ? strlen(entry.name) : 16) + 2;
+		char* name = (char*)malloc(nameLength);
+		if (valid)
+			snprintf(name, nameLength, "%s:%s", path, entry.name);
+		else
+			snprintf(name, nameLength, "%s:#%u", path, i);
+		
+		// the record is made from the entry as if the headers had been read
+		ConversionJob job;
+		job.filename = name;
+		if (valid) {
+			job.inputFileType = entry.format;
+			job.inputContainer = entry.container;
+			job.width = entry.width;
+			job.height = entry.height;
+			job.inputMipLevels = entry.mipLevels;
+			job.fsHeader = (entry.flags & BUNDLE_FS70) != 0;
+			job.inputFileSize = (unsigned int)entry.size;
+			job.inputPayloadSize = job.mipChainSize(entry.format, entry.mipLevels);
+			if (job.inputPayloadSize == 0 || job.inputPayloadSize > entry.size - entry.headerSize)
+				job.inputPayloadSize = (unsigned int)(entry.size - entry.headerSize);
+		}
+		addInspectRecord(index, job.inspectRecord(valid ? NULL : "Bundle entry is corrupt.", entry.headerSize));
+		free(name);
+	}
+	unmapBundle(&bundle);
+	return true;
+}
+
+// Creates the directories a name taken from a bundle lies in
+void makeParentDirectories(const char* name) {
+	size_t nameLength = strlen(name);
+	char* path = (char*)malloc(nameLength + 1);
+	memcpy(path, name, nameLength + 1);
+	for (size_t i = 1; i < nameLength; i++) {
+		if (path[i] != '/' && path[i] != '\\')
+			continue;
+		char separator = path[i];
+		path[i] = '\0';
+#if defined(_WIN32) || defined(WIN32)
+		CreateDirectoryA(path, NULL);
+#else
+		mkdir(path, 0777);
+#endif
+		path[i] = separator;
+	}
+	free(path);
+}
+
+// --extract: writes the named files, or all of them, out of a bundle into the current directory.
+// Returns the number of files that could not be written.
+int runExtract(const char* path, char* names[], int nameCount) {
+	MappedBundle bundle;
+	int mapped = mapBundle(path, &bundle);
+	if (mapped != 0) {
+		printf("%s: %s\n", path, mapped == 1 ? "File not found." : "Not a texture bundle, or corrupt.");
+		return -1;
+	}
+	
+	int total = nameCount > 0 ? nameCount : (int)bundle.count;
+	int failed = 0;
+	for (int i = 0; i < total; i++) {
+#ifdef USE_TASKLOOP
+#pragma omp task firstprivate(i) shared(bundle, failed)
+#endif
+		{
+			int found = nameCount > 0 ? findBundleEntry(&bundle, names[i]) : i;
+			BundleEntry entry;
+			bool valid = found >= 0 && readBundleEntry(&bundle, found, &entry);
+			bool written = false;
+			
+			ConversionJob job;
+			job.report("\nFile %d: %s:\n", i + 1, nameCount > 0 ? names[i] : valid ? entry.name : "?");
+			if (found < 0)
+				job.report("\tNot in %s.\n", path);
+			else if (!valid)
+				job.report("\tBundle entry is corrupt.\n");
+			else if (!isRelativeName(entry.name))
+				job.report("\tNot written: %s would lie outside the current directory.\n", entry.name);
+			else {
+				makeParentDirectories(entry.name);
+				FILE* out;
+#if defined(_WIN32) || defined(WIN32)
+				fopen_s(&out, entry.name, "wb");
+#else
+				out = fopen(entry.name, "wb");
+#endif
+				written = out != NULL && fwrite(bundle.data + entry.offset, 1, (size_t)entry.size, out) == entry.size;
+				if (out != NULL && fclose(out) != 0)
+					written = false;
+				job.report(written ? "\tWrite OK: %s\n" : "\tWrite error: %s\n", entry.name);
+			}
+			if (!written) {
+#pragma omp atomic
+				failed++;
+			}
+			job.flushReport();
+		}
+	}
+#ifdef USE_TASKLOOP
+#pragma omp taskwait
+#endif
+	
+	unmapBundle(&bundle);
+	return failed;
+}
+
+int compareRecords(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Lists the header details of every file and directory named, sorted by path
+void runInspect(char* files[], int fileCount) {
+	InspectIndex index = { NULL, 0, 0 };
+	
+#ifdef USE_TASKLOOP
+#pragma omp taskgroup
+#endif
+	{
+		for (int i = 0; i < fileCount; i++) {
+			if (!inspectDirectory(&index, files[i]) && !inspectBundle(&index, files[i]))
+				inspectFile(&index, files[i]);
+		}
+	}
+	
+	qsort(index.records, index.count, sizeof(char*), compareRecords);
+	
+	if (inspectFormat == INSPECT_CSV) {
+		printf("file,status,container,format,width,height,mipLevels,fs70,fileSize,headerSize,payloadSize,wastedBytes,error\n");
+		for (int i = 0; i < index.count; i++)
+			fputs(index.records[i], stdout);
+	} else {
+		printf("[");
+		for (int i = 0; i < index.count; i++)
+			printf("%s\n%s", i == 0 ? "" : ",", index.records[i]);
+		printf("\n]\n");
+	}
+	
+	for (int i = 0; i < index.count; i++)
+		free(index.records[i]);
+	free(index.records);
+}
+
+// Reads a file's headers and applies the job's selection; no pixel data is read yet
+bool prepareFile(ConversionJob* job, const char* name) {
+	if (!job->load(name))
+		return false;
+	if (job->options->previewSize > 0 || job->selectOutput(job->options->selection) == 0)
+		return true;
+	job->report("\tError: this file type cannot be %s.\n", job->options->selection == '4' ? "rewrapped" : "transformed");
+	return false;
+}
+
+// Converts a prepared file, or makes its preview.  Returns whether the file was written.
+bool finishFile(ConversionJob* job) {
+	if (job->options->previewSize > 0)
+		return job->writePreview(job->options->previewSize);
+	return job->convert();
+}
+
+// Converts a file with the job's selection, or makes its preview, without asking.
+// Returns whether the file was written.
+bool runFile(ConversionJob* job, const char* name) {
+	return prepareFile(job, name) && finishFile(job);
+}
+
+// Memory the jobs running now are estimated to hold at their peak, and how many times a job
+// has handed its share back.  They are kept under a lock rather than a critical section so that
+// a thread waiting for room can sleep until the next release.
+unsigned long long memInUse = 0;
+unsigned long long memReleases = 0;
+#if defined(_WIN32) || defined(WIN32)
+SRWLOCK memLock = SRWLOCK_INIT;
+CONDITION_VARIABLE memReleased = CONDITION_VARIABLE_INIT;
+#else
+pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t memReleased = PTHREAD_COND_INITIALIZER;
+#endif
+
+void lockMemory() {
+#if defined(_WIN32) || defined(WIN32)
+	AcquireSRWLockExclusive(&memLock);
+#else
+	pthread_mutex_lock(&memLock);
+#endif
+}
+
+void unlockMemory() {
+#if defined(_WIN32) || defined(WIN32)
+	ReleaseSRWLockExclusive(&memLock);
+#else
+	pthread_mutex_unlock(&memLock);
+#endif
+}
+
+// Reserves a job's estimated memory if it fits into --mem-budget next to the jobs already
+// running.  A job bigger than the whole budget gets through once nothing else is running.
+bool reserveMemory(unsigned long long size) {
+	bool reserved = false;
+	lockMemory();
+	if (memBudget == 0 || memInUse == 0 || memInUse + size <= memBudget) {
+		memInUse += size;
+		reserved = true;
+	}
+	unlockMemory();
+	return reserved;
+}
+
+void releaseMemory(unsigned long long size) {
+	lockMemory();
+	memInUse -= size;
+	memReleases++;
+	unlockMemory();
+#if defined(_WIN32) || defined(WIN32)
+	WakeAllConditionVariable(&memReleased);
+#else
+	pthread_cond_broadcast(&memReleased);
+#endif
+}
+
+// The number of releases so far; taken before trying to reserve, and handed to waitForMemory
+unsigned long long memoryReleases() {
+	lockMemory();
+	unsigned long long releases = memReleases;
+	unlockMemory();
+	return releases;
+}
+
+// Waits until a running job has released memory since seen was taken.  Queued tasks get the
+// thread first, since one of them may be what frees the memory.
+void waitForMemory(unsigned long long seen) {
+#ifdef USE_TASKLOOP
+#pragma omp taskyield
+#endif
+	lockMemory();
+	while (memReleases == seen && memInUse > 0) {
+#if defined(_WIN32) || defined(WIN32)
+		SleepConditionVariableSRW(&memReleased, &memLock, INFINITE, 0);
+#else
+		pthread_cond_wait(&memReleased, &memLock);
+#endif
+	}
+	unlockMemory();
+}
+
+#define ADMISSION_WINDOW 64 // files whose headers are read ahead while waiting for memory
+
+// runBatch under --mem-budget: headers are read up front to estimate each file's memory, and
+// every waiting file that fits is started, so small files flow past a large one waiting for room.
+// Returns the number of files that failed.
+int runBudgeted(char* files[], int fileCount) {
+	ConversionJob* waiting[ADMISSION_WINDOW];
+	int waitingCount = 0;
+	int next = 0;
+	int failed = 0;
+	
+	for (int i = 0; i < fileCount && i < (int)ioDepth; i++)
+		prefetchFile(files[i]);
+	
+	while (next < fileCount || waitingCount > 0) {
+		while (next < fileCount && waitingCount < ADMISSION_WINDOW) {
+			if (next + (int)ioDepth < fileCount)
+				prefetchFile(files[next + ioDepth]);
+			ConversionJob* job = new ConversionJob;
+			job->report("\nFile %d: %s:\n", next + 1, files[next]);
+			if (prepareFile(job, files[next])) {
+				waiting[waitingCount++] = job;
+			} else {
+				failed++;
+				delete job;
+			}
+			next++;
+		}
+		
+		bool started = false;
+		unsigned long long seen = memoryReleases();
+		for (int w = 0; w < waitingCount; ) {
+			ConversionJob* job = waiting[w];
+			unsigned long long size = job->peakFootprint();
+			if (!reserveMemory(size)) {
+				w++;
+				continue;
+			}
+			if (memBudget > 0 && size > memBudget)
+				job->report("\tNeeds about %llu MB, more than --mem-budget; converting it on its own.\n", size >> 20);
+			memmove(waiting + w, waiting + w + 1, (waitingCount - w - 1) * sizeof(ConversionJob*));
+			waitingCount--;
+			started = true;
+			
+			// a lone thread would never get back to deferred tasks while waiting for memory;
+			// while profiling, each file runs on its own so its kernels are charged only for themselves
+#ifdef USE_TASKLOOP
+#pragma omp task firstprivate(job, size) shared(failed) if (omp_get_num_threads() > 1 && !profiling)
+#endif
+			{
+				if (!finishFile(job)) {
+#pragma omp atomic
+					failed++;
+				}
+				delete job;
+				releaseMemory(size);
+			}
+		}
+		if (!started && waitingCount > 0)
+			waitForMemory(seen);
+	}
+#ifdef USE_TASKLOOP
+#pragma omp taskwait
+#endif
+	return failed;
+}
+
+// Converts every file with the --to selection (or makes previews) without asking,
+// with all files in flight at once sharing the thread pool.  Returns the number of files that failed.
+int runBatch(char* files[], int fileCount) {
+	int failed = 0;
+	bool readingAhead = startReadAhead(files, fileCount);
+	for (int i = 0; i < fileCount && i < (int)ioDepth && !readingAhead; i++)
+		prefetchFile(files[i]);
 	
-	// Flight Simulator Compatible header
-	outputHeaderBuffer[54] = 'F';
-	outputHeaderBuffer[55] = 'S';
-	outputHeaderBuffer[56] = '7';
-	outputHeaderBuffer[57] = '0';
-	outputHeaderBuffer[58] = (unsigned char)0x14;
-	outputHeaderBuffer[63] = (unsigned char)0x4; // This is 4 for 32-bit, DXT3, DXT5; 1 for DXT1; 2 for DXT1A
+	for (int i = 0; i < fileCount; i++) {
+		// while profiling, each file runs on its own so its kernels are charged only for themselves
+#ifdef USE_TASKLOOP
+#pragma omp task firstprivate(i) shared(failed, readingAhead) if (!profiling)
+#endif
+		{
+			// with read-ahead the files go out in the order they were read, whatever order the tasks run in
+			ConversionJob job;
+			int file = i;
+			if (readingAhead)
+				file = nextReadAhead(&job.streamBuffer, &job.inputFileSize);
+			else if (i + (int)ioDepth < fileCount)
+				prefetchFile(files[i + ioDepth]);
+			
+			job.report("\nFile %d: %s:\n", file + 1, files[file]);
+			if (!runFile(&job, files[file])) {
+#pragma omp atomic
+				failed++;
+			}
+			job.flushReport();
+		}
+	}
+#ifdef USE_TASKLOOP
+#pragma omp taskwait
+#endif
+	if (readingAhead)
+		stopReadAhead();
+	return failed;
 }
 
-void makeOutputHeader_FS_32() {
-	outputHeaderSize = 74;
-	outputFileSize = outputHeaderSize + outputBufferSize;
-	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
-	outputHeaderBuffer[0] = 'B';
-	outputHeaderBuffer[1] = 'M';
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
-	outputHeaderBuffer[10] = (unsigned char)0x4a; // index where image starts 74
-	outputHeaderBuffer[14] = (unsigned char)0x28;
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
-	outputHeaderBuffer[26] = (unsigned char)0x1;
-	outputHeaderBuffer[28] = (unsigned char)0x20; // bitdepth 32
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
-	
-	// Flight Simulator Compatible header
-	outputHeaderBuffer[54] = 'F';
-	outputHeaderBuffer[55] = 'S';
-	outputHeaderBuffer[56] = '7';
-	outputHeaderBuffer[57] = '0';
-	outputHeaderBuffer[58] = (unsigned char)0x14;
-	outputHeaderBuffer[63] = (unsigned char)0x4; // This is 4 for 32-bit, DXT3, DXT5; 1 for DXT1; 2 for DXT1A
-}
+#if !defined(_WIN32) && !defined(WIN32)
+#define REQUEST_MAX 65536
+#define PAYLOAD_MAX ((unsigned int)1 << 30) // most standard input a request may hand over, if --mem-budget is not less
 
-void makeOutputHeader_STD_24() {
-	outputHeaderSize = 54;
-	outputFileSize = outputHeaderSize + outputBufferSize;
-	outputHeaderBuffer = (unsigned char*)calloc(outputHeaderSize, sizeof(unsigned char));
-	outputHeaderBuffer[0] = 'B';
-	outputHeaderBuffer[1] = 'M';
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 2, outputFileSize);
-	outputHeaderBuffer[10] = (unsigned char)0x36; // index where image starts 54
-	outputHeaderBuffer[14] = (unsigned char)0x28;
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 18, width);
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 22, height);
-	outputHeaderBuffer[26] = (unsigned char)0x1;
-	outputHeaderBuffer[28] = (unsigned char)0x18; // bitdepth 24
-	bufferWriteLittleEndianInt(outputHeaderBuffer, 34, outputBufferSize);
+volatile sig_atomic_t daemonStopping = 0;
+
+void stopDaemon(int) {
+	daemonStopping = 1;
 }
 
-bool convertToOutput() {
-	switch (outputFileType) {
-	case STD_24:
-		outputBufferSize = width * height * 3;
-		outputFileBuffer = (unsigned char*)malloc(outputBufferSize * sizeof(unsigned char));
-		makeOutputHeader_STD_24();
-		return conv_32_to_24(convertFileBuffer, outputFileBuffer);
-	case FS_32:
-		outputBufferSize = width * height * 4;
-		outputFileBuffer = convertFileBuffer;
-		convertFileBuffer = NULL;
-		makeOutputHeader_FS_32();
-		return true;
-	case FS_DXT3:
-		outputBufferSize = width * height;
-		outputFileBuffer = (unsigned char*)malloc(outputBufferSize * sizeof(unsigned char));
-		makeOutputHeader_FS_dxt3();
-		return conv_32_to_dxt3(convertFileBuffer, outputFileBuffer);
-	default:
-		return false;
-	}
+// A path sent by a client, made absolute against the client's working directory
+char* resolveClientPath(const char* cwd, const char* path) {
+	if (path[0] == '/' || strcmp(path, "-") == 0)
+		return strdup(path);
+	size_t length = strlen(cwd) + strlen(path) + 2;
+	char* resolved = (char*)malloc(length);
+	snprintf(resolved, length, "%s/%s", cwd, path);
+	return resolved;
 }
 
-bool writeOutputFile() {
-	if (outputHeaderBuffer == NULL || outputFileBuffer == NULL)
-		return false;
-	for (unsigned int i = 0; i < outputHeaderSize; i++) {
-		putc((int)outputHeaderBuffer[i], bmpFile);
+// Runs one client's request: its files one after another, each reported back with its time
+void serveClient(int client) {
+	unsigned char lengthBuffer[4];
+	char* request = NULL;
+	unsigned char* payload = NULL;
+	unsigned int requestLength = 0;
+	unsigned int payloadLength = 0;
+	bool received = readFully(client, lengthBuffer, 4);
+	if (received) {
+		requestLength = bufferReadLittleEndianInt(lengthBuffer, 0);
+		received = requestLength > 0 && requestLength <= REQUEST_MAX;
 	}
-	for (unsigned int i = 0; i < outputBufferSize; i++) {
-		putc((int)outputFileBuffer[i], bmpFile);
+	if (received) {
+		request = (char*)malloc(requestLength);
+		received = readFully(client, request, requestLength) && request[requestLength - 1] == '\0' && readFully(client, lengthBuffer, 4);
 	}
-	return true;
+	if (received) {
+		payloadLength = bufferReadLittleEndianInt(lengthBuffer, 0);
+		unsigned long long payloadLimit = memBudget > 0 && memBudget < PAYLOAD_MAX ? memBudget : PAYLOAD_MAX;
+		if (payloadLength > payloadLimit) {
+			char error[160];
+			snprintf(error, sizeof(error), "\tInvalid request; %u bytes of standard input is more than the daemon takes (%llu).\n",
+				payloadLength, payloadLimit);
+			sendRecord(client, 'M', error, (unsigned int)strlen(error));
+			unsigned char status[4];
+			bufferWriteLittleEndianInt(status, 0, 1);
+			sendRecord(client, 'E', status, 4);
+			received = false;
+		}
+	}
+	if (received) {
+		payload = (unsigned char*)malloc(payloadLength > 0 ? payloadLength : 1);
+		received = readFully(client, payload, payloadLength);
+	}
+	if (!received) {
+		free(request);
+		free(payload);
+		close(client);
+		return;
+	}
+	
+	// argv[0] is the client's working directory
+	int argc = 0;
+	for (unsigned int i = 0; i < requestLength; i++)
+		if (request[i] == '\0')
+			argc++;
+	char** argv = (char**)malloc(argc * sizeof(char*));
+	char** files = (char**)malloc(argc * sizeof(char*));
+	char** paths = (char**)malloc(argc * sizeof(char*));
+	for (int i = 0, at = 0; i < argc; i++) {
+		argv[i] = request + at;
+		at += (int)strlen(argv[i]) + 1;
+	}
+	
+	JobOptions options;
+	int fileCount = parseArguments(argc, argv, files, &options, true);
+	unsigned int failed = 0;
+	if (fileCount <= 0 || !checkFileArguments(files, fileCount, &options) || (options.selection == 0 && options.previewSize == 0)) {
+		const char* error = "\tInvalid request; the daemon needs files and --to, --auto or --preview.\n";
+		sendRecord(client, 'M', error, (unsigned int)strlen(error));
+		failed = fileCount > 0 ? fileCount : 1;
+		fileCount = 0;
+	}
+	
+	char* output = options.output != NULL ? resolveClientPath(argv[0], options.output) : NULL;
+	options.output = output;
+	char* streamData = NULL;
+	size_t streamLength = 0;
+	FILE* stream = fileCount > 0 && writesToStream(files, fileCount, &options) ? open_memstream(&streamData, &streamLength) : NULL;
+	
+	for (int i = 0; i < fileCount; i++) {
+		paths[i] = resolveClientPath(argv[0], files[i]);
+		
+		ConversionJob job;
+		job.options = &options;
+		job.replySocket = client;
+		job.streamOutput = stream;
+		if (strcmp(paths[i], "-") == 0) {
+			job.streamBuffer = payload;
+			job.inputFileSize = payloadLength;
+			payload = NULL;
+		}
+		
+		struct timespec started, finished;
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		job.report("\nFile %d: %s:\n", i + 1, files[i]);
+		if (prepareFile(&job, paths[i])) {
+			// requests from other clients share --mem-budget
+			unsigned long long size = job.peakFootprint();
+			unsigned long long seen = memoryReleases();
+			while (!reserveMemory(size)) {
+				waitForMemory(seen);
+				seen = memoryReleases();
+			}
+			if (!finishFile(&job))
+				failed++;
+			releaseMemory(size);
+		} else {
+			failed++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &finished);
+		job.report("\tTime: %.3f ms\n", (finished.tv_sec - started.tv_sec) * 1000.0 + (finished.tv_nsec - started.tv_nsec) / 1000000.0);
+		job.flushReport();
+		free(paths[i]);
+	}
+	
+	if (stream != NULL) {
+		fclose(stream);
+		sendRecord(client, 'D', streamData, (unsigned int)streamLength);
+		free(streamData);
+	}
+	unsigned char status[4];
+	bufferWriteLittleEndianInt(status, 0, failed);
+	sendRecord(client, 'E', status, 4);
+	close(client);
+	
+	free(output);
+	free(paths);
+	free(files);
+	free(argv);
+	free(request);
+	free(payload);
 }
 
-int main(int argc, char* argv[]) {
-	printf("This program converts standard 24-bit bitmaps and Adobe Photoshop\n");
-	printf("32-bit bitmaps into a 32-bit format that is recognized by Microsoft\n");
-	printf("Flight Simulator.\n\n");
-	printf("Copyright (c) 2013 Brian Chau.\n");
-	printf("Build %s\n", BUILD_VERSION);
-	printf("This is an ALPHA build; as testing is not complete, this program may be harmful\nto your computer. The developer is not responsible for any damage.\n");
+// Serves requests on a Unix socket until interrupted.  Each request is a task for the one
+// thread team, so threads, allocator and page cache stay warm from one request to the next.
+int runDaemon(const char* path) {
+	struct sockaddr_un address;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("\tSocket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
 	
-	if (argc <= 1) {
-#if defined(_WIN32) || defined(WIN32)
-		printf("Drag files into the program to convert them.\n\n");
-		printf("Program terminated.\n");
-		system("PAUSE"); // needed for Windows to prevent the program from terminating and the command window to close
-#else
-		printf("Usage: %s file1 [file2 file3 ...]\n\n", argv[0]);
-		printf("Program terminated.\n");
+	// a socket left behind by a daemon that did not shut down cleanly
+	struct stat info;
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path);
+	
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+		printf("\tCannot listen on %s: %s\n", path, strerror(errno));
+		if (listener >= 0)
+			close(listener);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stopDaemon);
+	signal(SIGTERM, stopDaemon);
+	printf("\nListening on %s.\n", path);
+	fflush(stdout);
+	
+	struct pollfd waiting;
+	waiting.fd = listener;
+	waiting.events = POLLIN;
+	while (!daemonStopping) {
+		if (poll(&waiting, 1, 250) <= 0)
+			continue;
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+			continue;
+		// a lone thread never leaves this loop to run queued tasks, so it serves the request itself
+#ifdef USE_TASKLOOP
+#pragma omp task firstprivate(client) if (omp_get_num_threads() > 1)
 #endif
+		serveClient(client);
+	}
+#ifdef USE_TASKLOOP
+#pragma omp taskwait
+#endif
+	
+	close(listener);
+	unlink(path);
+	return 0;
+}
+
+// Sends this command line to a --daemon and passes on what comes back.
+// Returns the number of files that failed, or -1 if the daemon could not be reached.
+int runClient(const char* path, int argc, char* argv[], char* files[], int fileCount) {
+	struct sockaddr_un address;
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	if (server < 0 || connect(server, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		printf("\tCannot reach the daemon at %s: %s\n", path, strerror(errno));
+		if (server >= 0)
+			close(server);
 		return -1;
 	}
+	signal(SIGPIPE, SIG_IGN);
+	
+	// the working directory, then every argument but --client and its socket
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		strcpy(cwd, "/");
+	size_t requestLength = strlen(cwd) + 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--client") == 0)
+			i++;
+		else
+			requestLength += strlen(argv[i]) + 1;
+	}
+	unsigned char* request = (unsigned char*)malloc(requestLength + 4);
+	bufferWriteLittleEndianInt(request, 0, (unsigned int)requestLength);
+	size_t at = 4;
+	memcpy(request + at, cwd, strlen(cwd) + 1);
+	at += strlen(cwd) + 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--client") == 0) {
+			i++;
+			continue;
+		}
+		memcpy(request + at, argv[i], strlen(argv[i]) + 1);
+		at += strlen(argv[i]) + 1;
+	}
 	
-	char* filename;
+	unsigned int payloadLength = 0;
+	unsigned char* payload = NULL;
+	for (int i = 0; i < fileCount; i++)
+		if (strcmp(files[i], "-") == 0) {
+			payload = readStandardInput(&payloadLength);
+			if (payload == NULL) {
+				printf("\tStandard input could not be read.\n");
+				free(request);
+				close(server);
+				return -1;
+			}
+		}
+	unsigned char lengthBuffer[4];
+	bufferWriteLittleEndianInt(lengthBuffer, 0, payloadLength);
+	// a refused request is answered without reading the payload, so the reply is read even if sending it fails
+	bool sent = writeFully(server, request, requestLength + 4) && writeFully(server, lengthBuffer, 4);
+	if (sent)
+		writeFully(server, payload, payloadLength);
+	free(request);
+	free(payload);
 	
+	int failed = -1;
+	unsigned char header[5];
+	while (sent && readFully(server, header, 5)) {
+		unsigned int length = bufferReadLittleEndianInt(header, 1);
+		unsigned char* data = (unsigned char*)malloc(length > 0 ? length : 1);
+		if (!readFully(server, data, length)) {
+			free(data);
+			break;
+		}
+		if (header[0] == 'M') {
+			fwrite(data, 1, length, stdout);
+			fflush(stdout);
+		} else if (header[0] == 'D') {
+			fwrite(data, 1, length, dataOutput);
+			fflush(dataOutput);
+		} else if (header[0] == 'E' && length == 4) {
+			failed = (int)bufferReadLittleEndianInt(data, 0);
+		}
+		free(data);
+		if (header[0] == 'E')
+			break;
+	}
+	close(server);
+	if (failed < 0)
+		printf("\tThe daemon at %s did not finish the request.\n", path);
+	return failed;
+}
+#endif
+
+// Asks what to do with each file in turn
+void runInteractive(char* files[], int fileCount) {
 	// local variables
 	char selection, sel_buffer;
 	int selection_counter;
-	int inputReadSuccess;
-	
-	// initialize some global buffers to NULL first
-	inputFileBuffer = NULL;
-	convertFileBuffer = NULL;
-	outputFileBuffer = NULL;
-	outputHeaderBuffer = NULL;
+	int prefetched = 0;
 	
-	for (int i = 1; i < argc; i++) {
+	for (int i = 0; i < fileCount; i++) {
 		
-		// Free buffers if they aren't freed already
-		if (inputFileBuffer != NULL)
-			free(inputFileBuffer);
-		if (convertFileBuffer != NULL)
-			free(convertFileBuffer);
-		if (outputFileBuffer != NULL)
-			free(outputFileBuffer);
-			inputFileBuffer = NULL;
-		if (outputHeaderBuffer != NULL)
-			free(outputHeaderBuffer);
-			inputFileBuffer = NULL;
+		// Keep reads in flight for the files coming up after this one
+		if (prefetched <= i)
+			prefetched = i + 1;
+		for (; prefetched < fileCount && prefetched <= i + (int)ioDepth; prefetched++)
+			prefetchFile(files[prefetched]);
 		
-		// assign to NULL
-		inputFileBuffer = NULL;
-		convertFileBuffer = NULL;
-		outputFileBuffer = NULL;
-		outputHeaderBuffer = NULL;
+		ConversionJob job;
 		
 		printf("\n");
-		// Set filename and print to console
-		filename = argv[i];
-		printf("File %d: %s:\n", i, filename);
-		
-		// Open the specified file and check existence
-#if defined(_WIN32) || defined(WIN32)
-		fopen_s(&bmpFile, filename, "rb");
-#else
-		bmpFile = fopen(filename, "rb");
-#endif
-		
-		if (bmpFile == NULL) {
-			// File cannot be opened or does not exist, error.
-			printf("\tFile not found.\n");
-			continue;
-		}
-		
-		// get filesize
-		fseek(bmpFile, 0, SEEK_END);
-		inputFileSize = (unsigned int)ftell(bmpFile);
-		rewind(bmpFile);
-		
-		// File size less than 54 (the size of the smallest header) implies corrupt
-		if (inputFileSize < 54) {
-			printf("\tFile invalid or corrupt.\n");
-			fclose(bmpFile);
-			continue;
-		}
-		
-		// At this point, we will try to process the file
-		inputReadSuccess = processFileInput();
-		
-		if (inputReadSuccess != 0) {
-			// File was not processed properly
-			switch (inputReadSuccess) {
-			case 1:
-				printf("\tFile invalid.\n");
-				break;
-			case 2:
-				printf("\tFile has a Flight Simulator header but is incompatible or corrupt.\n");
-				break;
-			case 3:
-				printf("\tFile may be corrupt.\n");
-				break;
-			case 4:
-				printf("\tFile must have same width and height.\n");
-				break;
-			case 5:
-				printf("\tFile dimensions must be a power of 2 and greater than 4px.\n");
-				break;
-			default:
-				printf("\tUndefined error.\n");
-				break;
-			}
-			fclose(bmpFile);
-			continue;
-		}
+		// Print filename to console
+		printf("File %d: %s:\n", i + 1, files[i]);
 		
-		if (inputFileType == UNKN) {
-			printf("\tUnsupported filetype.\n");
-			fclose(bmpFile);
+		bool loaded = job.load(files[i]);
+		job.flushReport();
+		if (!loaded)
 			continue;
-		}
-		
-		printf("\tRead OK.  File type: %s\n", filetype[inputFileType]);
-		if (mips)
-			printf("\tWarning: the original file contains mipmaps. Note that the converted image will not have mipmaps.\n");
 		
 		// Now we ask what file type to convert to
 select:
-		printf("\tConvert to what file type?\n\t\t1. Flight Simulator 32-bit\n\t\t2. Flight Simulator DXT3\n\t\t3. Standard 24-bit\n\t\t0. Do nothing.\n");
+		printf("\tConvert to what file type?\n\t\t1. Flight Simulator 32-bit\n\t\t2. Flight Simulator DXT3\n\t\t3. Standard 24-bit\n");
+		printf("\t\t4. Rewrap as %s without re-encoding\n", job.inputContainer == CONT_DDS ? "Flight Simulator bitmap" : "DDS");
+		printf("\t\t5. Flip vertically\n\t\t6. Mirror horizontally\n\t\t7. Rotate 180 degrees\n");
+		printf("\t\t8. Choose automatically: the smallest Flight Simulator format that keeps the quality\n");
+		printf("\t\t9. 16-bit with bit masks (%s)\n", jobOptions.layout == LAYOUT_AUTO ? "565, 1555 or 4444 to suit the alpha" : layoutNames[jobOptions.layout]);
+		printf("\t\tn. Flight Simulator DXT5 normal map (X in alpha, Y in green)\n\t\t0. Do nothing.\n");
 		printf("\t\tType selection then press enter:  ");
 		selection_counter = 0;
 #if defined(_WIN32) || defined(WIN32)
@@ -1100,65 +5274,210 @@ select:
 			goto select;
 		}
 		
-		switch (selection) {
-		case '0':
-			break;
-		case '1':
-			outputFileType = FS_32;
-			break;
-		case '2':
-			outputFileType = FS_DXT3;
-			break;
-		case '3':
-			outputFileType = STD_24;
-			break;
-		default:
+		switch (job.selectOutput(selection)) {
+		case 1:
 			printf("\tError: invalid selection.\n\n");
 			goto select;
+		case 2:
+			printf("\tError: this file type cannot be rewrapped.\n\n");
+			goto select;
+		case 3:
+			printf("\tError: this file type cannot be transformed.\n\n");
+			goto select;
 		}
 		
-		if (outputFileType == inputFileType || outputFileType == UNKN) {
-			printf("\tNo conversion was required.  Original file unchanged.\n");
-			fclose(bmpFile);
-			continue;
-		}
-		
-		printf("\tOutput to file type: %s\n", filetype[outputFileType]);
-		
-		// Next we convert the file to 32-bit input
-		if (!initialConvertTo32()) {
-			printf("\tEncode error. Original file unchanged.\n");
-			fclose(bmpFile);
-			continue;
-		}
-		
-		// Close original file
-		fclose(bmpFile);
-		
-		// Covert to output
-		if (!convertToOutput()) {
-			printf("\tEncode error. Original file unchanged.\n");
-			continue;
-		}
-		
-		// Open new file for output
+		job.convert();
+		job.flushReport();
+	}
+}
+
+int main(int argc, char* argv[]) {
+	char** files = (char**)malloc(argc * sizeof(char*));
+	int fileCount = parseArguments(argc, argv, files, &jobOptions, false);
+	dataOutput = stdout;
+	if (fileCount > 0 && !checkFileArguments(files, fileCount, &jobOptions))
+		fileCount = -1;
+	if (daemonPath != NULL && fileCount != 0)
+		fileCount = -1;
+	// a bundle only takes converted files; previews and streams have no place in it
+	if (bundlePath != NULL && (fileCount <= 0 || jobOptions.selection == 0 || jobOptions.previewSize > 0 || daemonPath != NULL
+		|| clientPath != NULL || inspectFormat != INSPECT_NONE || writesToStream(files, fileCount, &jobOptions)))
+		fileCount = -1;
+	if (extractPath != NULL && (bundlePath != NULL || daemonPath != NULL || clientPath != NULL || inspectFormat != INSPECT_NONE
+		|| jobOptions.selection != 0 || jobOptions.previewSize > 0 || jobOptions.output != NULL))
+		fileCount = -1;
+	if (profiling && (daemonPath != NULL || clientPath != NULL || inspectFormat != INSPECT_NONE || extractPath != NULL))
+		fileCount = -1;
+	
+	// Image data on standard output must not be mixed with messages, so those move to standard error
+	if (fileCount > 0 && inspectFormat == INSPECT_NONE && writesToStream(files, fileCount, &jobOptions)) {
+		fflush(stdout);
 #if defined(_WIN32) || defined(WIN32)
-		fopen_s(&bmpFile, filename, "wb");
+		int fd = _dup(1);
+		_setmode(fd, _O_BINARY);
+		_dup2(2, 1);
+		dataOutput = _fdopen(fd, "wb");
 #else
-		bmpFile = fopen(filename, "wb");
+		int fd = dup(1);
+		dup2(2, 1);
+		dataOutput = fdopen(fd, "wb");
 #endif
-		
-		// Write to output file
-		writeOutputFile();
-		printf("\tWrite OK.\n");
-		fclose(bmpFile);
 	}
 	
+#if !defined(_WIN32) && !defined(WIN32)
+	// The daemon does the work; its threads are already running
+	if (clientPath != NULL && fileCount > 0) {
+		int failed = runClient(clientPath, argc, argv, files, fileCount);
+		free(files);
+		return failed;
+	}
+#endif
+	
+	int supportedCpuLevel = detectCpuLevel();
+	cpuLevel = supportedCpuLevel;
+	if (cpuRequest > supportedCpuLevel) {
+		printf("This machine does not support %s; it supports up to %s.\n", cpuLevelNames[cpuRequest], cpuLevelNames[supportedCpuLevel]);
+		free(files);
+		return -1;
+	}
+	if (cpuRequest >= 0)
+		cpuLevel = cpuRequest;
+	
+	if (showVersion && fileCount <= 0) {
+#ifdef _OPENMP
+		if (threadCount > 0)
+			omp_set_num_threads(threadCount);
+#endif
+		printVersion(supportedCpuLevel);
+		free(files);
+		return 0;
+	}
+	
+	// taking files out of a bundle converts nothing
+	if (extractPath != NULL && fileCount >= 0) {
+#ifdef _OPENMP
+		if (threadCount > 0)
+			omp_set_num_threads(threadCount);
+#endif
+		int failed = 0;
+#ifdef USE_TASKLOOP
+#pragma omp parallel
+#pragma omp single
+#endif
+		failed = runExtract(extractPath, files, fileCount);
+		free(files);
+		return failed;
+	}
+	
+	// --inspect output is meant for other programs, so it goes out on its own
+	if (fileCount > 0 && inspectFormat != INSPECT_NONE) {
+#ifdef _OPENMP
+		if (threadCount > 0)
+			omp_set_num_threads(threadCount);
+#endif
+#ifdef USE_TASKLOOP
+#pragma omp parallel
+#pragma omp single
+#endif
+		runInspect(files, fileCount);
+		free(files);
+		return 0;
+	}
+	
+	printf("This program converts standard 24-bit bitmaps and Adobe Photoshop\n");
+	printf("32-bit bitmaps into a 32-bit format that is recognized by Microsoft\n");
+	printf("Flight Simulator.\n\n");
+	printf("Copyright (c) 2013 Brian Chau.\n");
+	printf("Build %s\n", BUILD_VERSION);
+	printf("This is an ALPHA build; as testing is not complete, this program may be harmful\nto your computer. The developer is not responsible for any damage.\n");
+	
+	if (fileCount < 0 || (fileCount == 0 && daemonPath == NULL)) {
+#if defined(_WIN32) || defined(WIN32)
+		if (argc <= 1)
+			printf("Drag files into the program to convert them.\n\n");
+		else
+			printf("Usage: %s [options] file1 [file2 file3 ...]\n\n", argv[0]);
+		printf("Program terminated.\n");
+		system("PAUSE"); // needed for Windows to prevent the program from terminating and the command window to close
+#else
+		printf("Usage: %s [options] file1 [file2 file3 ...]\n", argv[0]);
+		printf("\t--to TYPE\tconvert every file without asking; TYPE is one of\n\t\t\tfs32, dxt3, std24, rewrap, flip, mirror, rotate, auto, mask16,\n\t\t\tdxt5nm (normal map: X in alpha, Y in green)\n");
+		printf("\t--auto\t\tsame as --to auto: pick the smallest format that keeps the quality\n");
+		printf("\t--layout L\t16-bit layout: 565, 1555, 4444 or auto (default)\n");
+		printf("\t--dither\tordered dither for 16-bit output\n");
+		printf("\t--renormalize\trescale normals to unit length after each --max-size halving of dxt5nm\n");
+		printf("\t--max-size N\thalve larger images until they are at most N pixels wide before converting\n");
+		printf("\t--preview SIZE\twrite name_preview.bmp, at most SIZE pixels wide, instead of converting\n");
+		printf("\t-o, --output NAME\n\t\t\twrite the result of the single file given to NAME\n");
+		printf("\t-\t\tas a file name, read standard input and write standard output;\n\t\t\tneeds --to, --auto or --preview\n");
+		printf("\t--inspect FMT\tlist the header details of the files, of every .bmp and .dds in the\n\t\t\tdirectories named and of every file in the bundles named,\n\t\t\tas json or csv; no pixel data is read\n");
+		printf("\t--bundle NAME\tpack the converted files into the bundle NAME instead of writing\n\t\t\tthem out; needs --to or --auto\n");
+		printf("\t--extract NAME\twrite the files named, or every file, out of the bundle NAME\n");
+		printf("\t--threads N\tuse N worker threads\n");
+		printf("\t--pin\t\tbind each worker thread to its own CPU\n");
+		printf("\t--mem-budget SIZE\n\t\t\tonly convert as many files at once as fit into SIZE megabytes\n\t\t\t(or use a K, M or G suffix), judged from their headers\n");
+		printf("\t--io-depth N\tstart reading the next N files ahead of time (default 4)\n");
+		printf("\t--cpu LEVEL\trun the block converters as baseline, sse4.1, avx2 or avx512\n\t\t\tinstead of the best this machine supports\n");
+		printf("\t--version\tshow the build and the instruction sets in use\n");
+		printf("\t--profile\tconvert one file at a time and report hardware counters (cycles,\n\t\t\tinstructions, cache and branch misses) for each kernel and thread\n");
+		printf("\t--daemon SOCKET\tserve conversion requests on a Unix socket until interrupted\n");
+		printf("\t--client SOCKET\thave the daemon on SOCKET convert the files instead; relative\n\t\t\tnames are taken from here and each file's time is reported\n\n");
+		printf("Program terminated.\n");
+#endif
+		free(files);
+		return -1;
+	}
+	
+#ifdef _OPENMP
+	if (threadCount > 0)
+		omp_set_num_threads(threadCount);
+	if (pinThreads) {
+#pragma omp parallel
+		pinThread(omp_get_thread_num());
+	}
+#endif
+	if (profiling)
+		profiling = startProfiling();
+	
+	if (bundlePath != NULL && !openBundle()) {
+		printf("\nCould not open %s for writing.\n", bundlePath);
+		free(files);
+		return -1;
+	}
+	
+	// One team of threads serves every file; the thread that runs the files
+	// hands out chunks of work that the others pick up as they become idle
+	int status = 0;
+#ifdef USE_TASKLOOP
+#pragma omp parallel
+#pragma omp single
+#endif
+	{
+#if !defined(_WIN32) && !defined(WIN32)
+		if (daemonPath != NULL)
+			status = runDaemon(daemonPath);
+		else
+#endif
+		// like --client, the exit status is the number of files that failed
+		if (memBudget > 0 && (jobOptions.selection != 0 || jobOptions.previewSize > 0))
+			status = runBudgeted(files, fileCount);
+		else if (jobOptions.selection != 0 || jobOptions.previewSize > 0)
+			status = runBatch(files, fileCount);
+		else
+			runInteractive(files, fileCount);
+	}
+	
+	if (bundlePath != NULL && !closeBundle())
+		status = -1;
+	if (profiling)
+		printProfile();
+	
+	free(files);
 	printf("\nProgram terminated.\n");
 	
 #if defined(_WIN32) || defined(WIN32)
 	system("PAUSE"); // needed for Windows to prevent the program from terminating and the command window to close
 #endif
 	
-	return 0;
+	return status;
 }